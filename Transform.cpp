@@ -2,20 +2,51 @@
 #include <clang/Sema/SemaConsumer.h>
 #include <clang/Sema/Scope.h>
 #include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/AST/Stmt.h>
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Decl.h>
+#include <clang/AST/Mangle.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Serialization/ASTWriter.h>
 #include <clang/Tooling/CommonOptionsParser.h>
+#include <clang/Tooling/JSONCompilationDatabase.h>
 #include <llvm/Option/OptTable.h>
 #include <llvm/Option/ArgList.h>
 #include <llvm/Option/Arg.h>
 #include <clang/Driver/Options.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/Path.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/Support/Mutex.h>
+#include <llvm/Support/MutexGuard.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Threading.h>
+#include <algorithm>
+#include <functional>
 #include <string>
+#include <set>
 #include <cctype>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "../../lib/Sema/TreeTransform.h"
 
 using namespace clang;
@@ -75,6 +106,271 @@ namespace {
     return QualType();
   }
 
+  // Options that control the generated code.
+  struct UPCTransformOptions {
+    UPCTransformOptions() : ReuseCSubtrees(true), StridedForAll(true), PrivatizeForAll(true), CoalesceFieldReads(true), BulkLoopLimit(4096), SplitPhaseGets(true), ReuseLoads(true), DeferPuts(false), StaticThreads(0), InlinePointerArithmetic(true), InductionPointers(true), ScopedTemps(true), OptLevel(0), SplitBarriers(-1), RemoveSyncs(-1), Remarks(false), FirstTouchLimit(0), Instrument(false), InstrumentSample(1), CommReport(false), TimeReport(false), TimeReportTop(10), AllocManifest(false), RewriteEngine(false) {}
+    // Don't rebuild statements that contain no UPC
+    bool ReuseCSubtrees;
+    // Lower upc_forall with affinity i + c or &a[i + c]
+    // to loops that only visit the iterations a thread owns
+    bool StridedForAll;
+    // Access elements with the same affinity as the
+    // upc_forall iteration through local pointers
+    bool PrivatizeForAll;
+    // Fetch shared structs whose fields are read several
+    // times in a statement with one get
+    bool CoalesceFieldReads;
+    // The largest buffer in bytes used to move the elements
+    // of a loop with one bulk get or put.  0 disables it.
+    unsigned BulkLoopLimit;
+    // Start independent relaxed reads in a statement with
+    // non-blocking gets
+    bool SplitPhaseGets;
+    // Load each relaxed location once per statement, and reuse
+    // it in following statements until it may have changed
+    bool ReuseLoads;
+    // Don't wait for relaxed puts to complete until the next
+    // point that can observe them
+    bool DeferPuts;
+    // Compile for exactly this many threads, folding THREADS
+    // into the layout arithmetic.  0 means THREADS is dynamic.
+    unsigned StaticThreads;
+    // Step phased pointers that stay in their block inline,
+    // with the element and block sizes as constants
+    bool InlinePointerArithmetic;
+    // Keep a pointer to a[i + c] in counted loops and
+    // advance it with i instead of recomputing it
+    bool InductionPointers;
+    // Declare temporaries in the innermost block that uses them,
+    // and reuse them in later statements once they're dead
+    bool ScopedTemps;
+    // The -O level of the compile command
+    unsigned OptLevel;
+    // Move private work between the notify and wait of
+    // a barrier.  -1 enables it at -O2 and above.
+    int SplitBarriers;
+    bool splitBarriers() const {
+      return SplitBarriers < 0? OptLevel >= 2 : SplitBarriers != 0;
+    }
+    // Drop barriers and fences that order nothing.
+    // -1 enables it at -O2 and above.
+    int RemoveSyncs;
+    bool removeSyncs() const {
+      return RemoveSyncs < 0? OptLevel >= 2 : RemoveSyncs != 0;
+    }
+    // Report the optimizations that were applied
+    bool Remarks;
+    // Have each thread zero its own blocks of uninitialized shared
+    // arrays of at least this many bytes at startup, so that their
+    // pages are first touched by the owner.  0 disables it.
+    unsigned FirstTouchLimit;
+    // Report shared accesses, barriers and upc_forall loops
+    // to a GASP performance tool.  The hooks report one access
+    // at a time, so this turns off bulk loops, split-phase gets
+    // and coalesced field reads.
+    bool Instrument;
+    // Only report one in this many accesses and barriers
+    unsigned InstrumentSample;
+    // Write a JSON summary of the communication of each function
+    // and the footprint of each shared variable next to the output
+    bool CommReport;
+    // Report the time and memory used by each phase of the
+    // translation, and the slowest top-level declarations
+    bool TimeReport;
+    unsigned TimeReportTop;
+    // Leave the shared variables with external linkage to one
+    // program-wide allocation table, written to <output>.alloc
+    bool AllocManifest;
+    // Edit the main file in place, replacing only the
+    // statements and declarations that the translation
+    // changed, instead of printing the whole translation unit
+    bool RewriteEngine;
+  };
+
+  // The arguments of UPCRT_STARTUP_(P)SHALLOC for one shared variable
+  struct SharedAllocation {
+    std::string Name;
+    bool Phaseless;
+    uint64_t BlockBytes;
+    uint64_t NumBlocks;
+    bool MultByThreads;
+    uint64_t ElementSize;
+    std::string TypeString;
+    bool operator==(const SharedAllocation& Other) const {
+      return Name == Other.Name && Phaseless == Other.Phaseless &&
+	BlockBytes == Other.BlockBytes && NumBlocks == Other.NumBlocks &&
+	MultByThreads == Other.MultByThreads && ElementSize == Other.ElementSize &&
+	TypeString == Other.TypeString;
+    }
+  };
+
+  // The manifest is a header line followed by one line per variable:
+  //   name phaseless blockbytes numblocks mult_by_threads elemsz typestr
+  static const char AllocManifestHeader[] = "upc2c-alloc-manifest 1";
+
+  static void PrintAllocManifestHeader(llvm::raw_ostream& OS) {
+    OS << AllocManifestHeader << "\n";
+  }
+
+  static void PrintAllocManifestEntry(const SharedAllocation& Alloc, llvm::raw_ostream& OS) {
+    OS << Alloc.Name << " " << Alloc.Phaseless << " " << Alloc.BlockBytes << " "
+       << Alloc.NumBlocks << " " << Alloc.MultByThreads << " " << Alloc.ElementSize << " "
+       << Alloc.TypeString << "\n";
+  }
+
+  static void PrintJSONString(llvm::raw_ostream& OS, StringRef Str) {
+    OS << '"';
+    for(StringRef::iterator iter = Str.begin(), end = Str.end(); iter != end; ++iter) {
+      unsigned char C = *iter;
+      if(C == '"' || C == '\\')
+	OS << '\\' << C;
+      else if(C < 0x20)
+	OS << llvm::format("\\u%04x", C);
+      else
+	OS << C;
+    }
+    OS << '"';
+  }
+
+  static bool ParseAllocManifest(StringRef Buffer, std::vector<SharedAllocation>& Result) {
+    SmallVector<StringRef, 16> Lines;
+    Buffer.split(Lines, "\n", -1, false);
+    if(Lines.empty() || Lines[0].rtrim() != AllocManifestHeader)
+      return false;
+    for(unsigned i = 1; i < Lines.size(); ++i) {
+      SmallVector<StringRef, 7> Fields;
+      Lines[i].rtrim().split(Fields, " ", -1, false);
+      if(Fields.size() != 7)
+	return false;
+      SharedAllocation Alloc;
+      unsigned Phaseless, Mult;
+      Alloc.Name = Fields[0];
+      if(Fields[1].getAsInteger(10, Phaseless) || Fields[2].getAsInteger(10, Alloc.BlockBytes) ||
+	 Fields[3].getAsInteger(10, Alloc.NumBlocks) || Fields[4].getAsInteger(10, Mult) ||
+	 Fields[5].getAsInteger(10, Alloc.ElementSize))
+	return false;
+      Alloc.Phaseless = Phaseless != 0;
+      Alloc.MultByThreads = Mult != 0;
+      Alloc.TypeString = Fields[6];
+      Result.push_back(Alloc);
+    }
+    return true;
+  }
+
+  // Returns true if T involves shared types anywhere.
+  static bool TypeHasUPC(QualType T) {
+    if(T.isNull()) return false;
+    QualType Ty = T.getCanonicalType();
+    if(Ty.getQualifiers().hasShared())
+      return true;
+    if(const PointerType *PT = Ty->getAs<PointerType>())
+      return TypeHasUPC(PT->getPointeeType());
+    if(const ArrayType *AT = dyn_cast<ArrayType>(Ty.getTypePtr()))
+      return TypeHasUPC(AT->getElementType());
+    if(const FunctionType *FT = Ty->getAs<FunctionType>()) {
+      if(TypeHasUPC(FT->getResultType()))
+	return true;
+      if(const FunctionProtoType *FPT = dyn_cast<FunctionProtoType>(FT)) {
+	for(FunctionProtoType::arg_type_iterator iter = FPT->arg_type_begin(), end = FPT->arg_type_end(); iter != end; ++iter) {
+	  if(TypeHasUPC(*iter))
+	    return true;
+	}
+      }
+    }
+    return false;
+  }
+
+  // Finds the statements and declarations that contain UPC
+  // constructs, i.e. anything that RemoveUPCTransform has to
+  // rewrite.  Everything else is plain C.
+  class UPCUsageFinder {
+  public:
+    // With FoldThreads, THREADS becomes a constant and so
+    // has to be rewritten too.
+    explicit UPCUsageFinder(bool Fold = false) : FoldThreads(Fold) {}
+    // Marks every statement under S that contains UPC.
+    // Returns whether S itself does.
+    bool mark(Stmt *S) {
+      if(!S) return false;
+      bool Found = isUPCNode(S);
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(mark(*Children))
+	  Found = true;
+      }
+      if(Found)
+	UPCStmts.insert(S);
+      return Found;
+    }
+    bool containsUPC(Stmt *S) const {
+      return UPCStmts.count(S) != 0;
+    }
+    void clear() { UPCStmts.clear(); }
+    bool declHasUPC(Decl *D) {
+      if(D == NULL) return false;
+      if(TypedefNameDecl *TD = dyn_cast<TypedefNameDecl>(D))
+	return TypeHasUPC(TD->getUnderlyingType());
+      if(RecordDecl *RD = dyn_cast<RecordDecl>(D)) {
+	for(RecordDecl::decl_iterator iter = RD->decls_begin(), end = RD->decls_end(); iter != end; ++iter) {
+	  if(declHasUPC(*iter))
+	    return true;
+	}
+	return false;
+      }
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(D)) {
+	if(TypeHasUPC(FD->getType()) || isMain(FD))
+	  return true;
+	return FD->doesThisDeclarationHaveABody() && mark(FD->getBody());
+      }
+      if(VarDecl *VD = dyn_cast<VarDecl>(D)) {
+	return TypeHasUPC(VD->getType()) || mark(VD->getInit());
+      }
+      if(ValueDecl *VD = dyn_cast<ValueDecl>(D))
+	return TypeHasUPC(VD->getType());
+      return false;
+    }
+  private:
+    static bool isMain(FunctionDecl *FD) {
+      return FD->getIdentifier() && FD->getIdentifier()->isStr("main");
+    }
+    bool isUPCNode(Stmt *S) {
+      if(isa<UPCForAllStmt>(S) || isa<UPCNotifyStmt>(S) ||
+	 isa<UPCWaitStmt>(S) || isa<UPCBarrierStmt>(S) ||
+	 isa<UPCFenceStmt>(S) || isa<UPCPragmaStmt>(S))
+	return true;
+      if(FoldThreads && isa<UPCThreadExpr>(S))
+	return true;
+      if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+	  if(declHasUPC(*iter))
+	    return true;
+	}
+	return false;
+      }
+      if(Expr *E = dyn_cast<Expr>(S)) {
+	if(TypeHasUPC(E->getType()))
+	  return true;
+	if(UnaryExprOrTypeTraitExpr *UE = dyn_cast<UnaryExprOrTypeTraitExpr>(E)) {
+	  return UE->getKind() == UETT_UPC_LocalSizeOf ||
+	    UE->getKind() == UETT_UPC_BlockSizeOf ||
+	    UE->getKind() == UETT_UPC_ElemSizeOf ||
+	    TypeHasUPC(UE->getTypeOfArgument());
+	}
+	if(CastExpr *CE = dyn_cast<CastExpr>(E)) {
+	  return CE->getCastKind() == CK_UPCSharedToLocal ||
+	    CE->getCastKind() == CK_UPCBitCastZeroPhase;
+	}
+	// main is renamed to user_main
+	if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+	  if(FunctionDecl *FD = dyn_cast<FunctionDecl>(DRE->getDecl()))
+	    return isMain(FD);
+	}
+      }
+      return false;
+    }
+    bool FoldThreads;
+    llvm::DenseSet<Stmt *> UPCStmts;
+  };
+
   struct UPCRDecls {
     FunctionDecl * upcr_notify;
     FunctionDecl * upcr_wait;
@@ -82,6 +378,7 @@ namespace {
     FunctionDecl * upcr_poll;
     FunctionDecl * upcr_mythread;
     FunctionDecl * upcr_threads;
+    FunctionDecl * upcr_global_exit;
     FunctionDecl * upcr_hasMyAffinity_pshared;
     FunctionDecl * upcr_hasMyAffinity_shared;
     FunctionDecl * UPCR_BEGIN_FUNCTION;
@@ -103,6 +400,16 @@ namespace {
     FunctionDecl * UPCR_PUT_SHARED_STRICT;
     FunctionDecl * UPCR_ADD_PSHAREDI;
     FunctionDecl * UPCR_ADD_PSHARED1;
+    FunctionDecl * upcrt_add_shared_blk;
+    FunctionDecl * upcrt_add_shared_pow2;
+    FunctionDecl * upcrt_init_shared_blocks;
+    FunctionDecl * upcrt_init_pshared_blocks;
+    FunctionDecl * upcrt_gasp_get_shared;
+    FunctionDecl * upcrt_gasp_get_pshared;
+    FunctionDecl * upcrt_gasp_put_shared;
+    FunctionDecl * upcrt_gasp_put_pshared;
+    FunctionDecl * upcrt_gasp_sync;
+    FunctionDecl * upcrt_gasp_forall;
     FunctionDecl * UPCR_INC_PSHAREDI;
     FunctionDecl * UPCR_INC_PSHARED1;
     FunctionDecl * UPCR_SUB_SHARED;
@@ -119,6 +426,12 @@ namespace {
     FunctionDecl * UPCR_SHARED_TO_PSHARED;
     FunctionDecl * UPCR_PSHARED_TO_SHARED;
     FunctionDecl * UPCR_SHARED_RESETPHASE;
+    FunctionDecl * upcr_nb_get_shared;
+    FunctionDecl * upcr_nb_get_pshared;
+    FunctionDecl * upcr_wait_syncnb;
+    FunctionDecl * upcr_nbi_put_shared;
+    FunctionDecl * upcr_nbi_put_pshared;
+    FunctionDecl * upcr_wait_syncnbi_puts;
     VarDecl * upcrt_forall_control;
     VarDecl * upcr_null_shared;
     VarDecl * upcr_null_pshared;
@@ -126,6 +439,7 @@ namespace {
     QualType upcr_pshared_ptr_t;
     QualType upcr_startup_shalloc_t;
     QualType upcr_startup_pshalloc_t;
+    QualType upcr_handle_t;
     SourceLocation FakeLocation;
     explicit UPCRDecls(ASTContext& Context) {
       SourceManager& SourceMgr = Context.getSourceManager();
@@ -139,6 +453,7 @@ namespace {
       upcr_pshared_ptr_t = CreateTypedefType(Context, "upcr_pshared_ptr_t", SharedPtrTy);
       upcr_startup_shalloc_t = CreateTypedefType(Context, "upcr_startup_shalloc_t");
       upcr_startup_pshalloc_t = CreateTypedefType(Context, "upcr_startup_pshalloc_t");
+      upcr_handle_t = CreateTypedefType(Context, "upcr_handle_t", Context.VoidPtrTy);
 
       // upcr_notify
       {
@@ -167,6 +482,11 @@ namespace {
       {
 	upcr_threads = CreateFunction(Context, "upcr_threads", Context.IntTy, 0, 0);
       }
+      // upcr_global_exit
+      {
+	QualType argTypes[] = { Context.IntTy };
+	upcr_global_exit = CreateFunction(Context, "upcr_global_exit", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
       // upcr_hasMyAffinity_pshared
       {
 	QualType argTypes[] = { upcr_pshared_ptr_t };
@@ -242,6 +562,57 @@ namespace {
 	QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
 	UPCR_ADD_PSHARED1 = CreateFunction(Context, "UPCR_ADD_PSHARED1", upcr_pshared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
       }
+      // upcrt_add_shared_blk
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.getSizeType(), Context.getPointerDiffType(), Context.getSizeType() };
+	upcrt_add_shared_blk = CreateFunction(Context, "upcrt_add_shared_blk", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_add_shared_pow2
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.getSizeType(), Context.getPointerDiffType(), Context.IntTy };
+	upcrt_add_shared_pow2 = CreateFunction(Context, "upcrt_add_shared_pow2", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_init_shared_blocks
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.getPointerType(Context.getConstType(Context.VoidTy)), Context.getSizeType(), Context.getSizeType(), Context.getSizeType() };
+	upcrt_init_shared_blocks = CreateFunction(Context, "upcrt_init_shared_blocks", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_init_pshared_blocks
+      {
+	QualType argTypes[] = { upcr_pshared_ptr_t, Context.getPointerType(Context.getConstType(Context.VoidTy)), Context.getSizeType(), Context.getSizeType(), Context.getSizeType() };
+	upcrt_init_pshared_blocks = CreateFunction(Context, "upcrt_init_pshared_blocks", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      QualType FileTy = Context.getPointerType(Context.getConstType(Context.CharTy));
+      // upcrt_gasp_get_shared
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy, Context.VoidPtrTy, upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
+	upcrt_gasp_get_shared = CreateFunction(Context, "upcrt_gasp_get_shared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_gasp_get_pshared
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy, Context.VoidPtrTy, upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
+	upcrt_gasp_get_pshared = CreateFunction(Context, "upcrt_gasp_get_pshared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_gasp_put_shared
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy, upcr_shared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	upcrt_gasp_put_shared = CreateFunction(Context, "upcrt_gasp_put_shared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_gasp_put_pshared
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy, upcr_pshared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	upcrt_gasp_put_pshared = CreateFunction(Context, "upcrt_gasp_put_pshared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_gasp_sync
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy, Context.IntTy, Context.IntTy };
+	upcrt_gasp_sync = CreateFunction(Context, "upcrt_gasp_sync", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcrt_gasp_forall
+      {
+	QualType argTypes[] = { FileTy, Context.IntTy, Context.IntTy };
+	upcrt_gasp_forall = CreateFunction(Context, "upcrt_gasp_forall", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
       // UPCR_INC_SHARED
       {
 	QualType argTypes[] = { Context.getPointerType(upcr_shared_ptr_t), Context.IntTy, Context.IntTy, Context.IntTy };
@@ -327,6 +698,35 @@ namespace {
 	QualType argTypes[] = { upcr_shared_ptr_t };
 	UPCR_SHARED_RESETPHASE = CreateFunction(Context, "UPCR_SHARED_RESETPHASE", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
       }
+      // upcr_nb_get_shared
+      {
+	QualType argTypes[] = { Context.VoidPtrTy, upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
+	upcr_nb_get_shared = CreateFunction(Context, "upcr_nb_get_shared", upcr_handle_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcr_nb_get_pshared
+      {
+	QualType argTypes[] = { Context.VoidPtrTy, upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
+	upcr_nb_get_pshared = CreateFunction(Context, "upcr_nb_get_pshared", upcr_handle_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcr_wait_syncnb
+      {
+	QualType argTypes[] = { upcr_handle_t };
+	upcr_wait_syncnb = CreateFunction(Context, "upcr_wait_syncnb", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcr_nbi_put_shared
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	upcr_nbi_put_shared = CreateFunction(Context, "upcr_nbi_put_shared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcr_nbi_put_pshared
+      {
+	QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	upcr_nbi_put_pshared = CreateFunction(Context, "upcr_nbi_put_pshared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+      }
+      // upcr_wait_syncnbi_puts
+      {
+	upcr_wait_syncnbi_puts = CreateFunction(Context, "upcr_wait_syncnbi_puts", Context.VoidTy, NULL, 0);
+      }
       // UPCR_BEGIN_FUNCTION
       {
 	UPCR_BEGIN_FUNCTION = CreateFunction(Context, "UPCR_BEGIN_FUNCTION", Context.VoidTy, NULL, 0);
@@ -410,8 +810,8 @@ namespace {
   class RemoveUPCTransform : public clang::TreeTransform<RemoveUPCTransform> {
     typedef TreeTransform<RemoveUPCTransform> TreeTransformUPC;
   public:
-    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid)
-      : TreeTransformUPC(S), AnonRecordID(0), Decls(D), FileString(fileid) {
+    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid, const UPCTransformOptions& Opts)
+      : TreeTransformUPC(S), Options(Opts), RemarkOS(0), CurrentComm(0), LoopDepth(0), Usage(Opts.StaticThreads != 0), ReusePlainC(false), CurrentFunctionBody(0), CurrentFunctionIsMain(false), DeferringPuts(false), BlockingPuts(false), AnonRecordID(0), Privatize(0), Coalesced(0), Bulk(0), Induction(0), SplitGets(0), Decls(D), FileString(fileid), NextTmpID(0) {
       UPCSystemHeaders.insert("upc.h");
       UPCSystemHeaders.insert("upc_bits.h");
       UPCSystemHeaders.insert("upc_castable.h");
@@ -430,6 +830,389 @@ namespace {
       UPCHeaderRenames["upc_types.h"] = "upcr_preinclude/upc_types.h";
     }
     bool AlwaysRebuild() { return true; }
+    const UPCTransformOptions& Options;
+    // Where remarks go, or NULL
+    llvm::raw_ostream *RemarkOS;
+    std::set<std::pair<unsigned, std::string> > Remarked;
+    void Remark(SourceLocation Loc, const Twine& Message) {
+      if(!RemarkOS)
+	return;
+      // Bodies that are transformed more than once
+      // shouldn't repeat their remarks.
+      if(!Remarked.insert(std::make_pair(Loc.getRawEncoding(), Message.str())).second)
+	return;
+      PresumedLoc PLoc = SemaRef.getSourceManager().getPresumedLoc(Loc);
+      if(PLoc.isValid())
+	*RemarkOS << PLoc.getFilename() << ":" << PLoc.getLine() << ":" << PLoc.getColumn() << ": ";
+      *RemarkOS << "remark: " << Message << "\n";
+    }
+    // With --comm-report, the shared accesses emitted for one
+    // source line at one loop depth
+    struct CommSite {
+      unsigned Line;
+      unsigned Depth;
+      bool IsPut;
+      bool Strict;
+      unsigned Count;
+      uint64_t Bytes;
+    };
+    struct ForAllInfo {
+      unsigned Line;
+      unsigned Depth;
+      const char *Affinity;
+      const char *Lowering;
+    };
+    struct FunctionComm {
+      std::string Name;
+      unsigned Line;
+      std::vector<CommSite> Sites;
+      unsigned Barriers;
+      std::vector<ForAllInfo> ForAlls;
+    };
+    std::vector<FunctionComm> CommReport;
+    // The function being transformed, or NULL outside functions
+    FunctionComm *CurrentComm;
+    // The number of loops around the statement being transformed
+    unsigned LoopDepth;
+    void NoteAccess(bool IsPut, bool Strict, uint64_t Bytes) {
+      if(!CurrentComm)
+	return;
+      CommSite Site = { GetLine(SemaRef.getSourceManager().getExpansionLoc(InstrumentLoc)), LoopDepth, IsPut, Strict, 1, Bytes };
+      for(std::vector<CommSite>::iterator iter = CurrentComm->Sites.begin(), end = CurrentComm->Sites.end(); iter != end; ++iter) {
+	if(iter->Line == Site.Line && iter->Depth == Site.Depth && iter->IsPut == IsPut && iter->Strict == Strict) {
+	  ++iter->Count;
+	  iter->Bytes += Bytes;
+	  return;
+	}
+      }
+      CurrentComm->Sites.push_back(Site);
+    }
+    // Returns the index of the record for S, to set its lowering later
+    std::size_t NoteForAll(UPCForAllStmt *S) {
+      if(!CurrentComm)
+	return std::size_t(-1);
+      const char *Affinity = !S->getAfnty()? "none" : isPointerToShared(S->getAfnty()->getType())? "pointer" : "integer";
+      // The loop itself has already been counted
+      ForAllInfo Info = { GetLine(SemaRef.getSourceManager().getExpansionLoc(S->getLocStart())), LoopDepth - 1, Affinity, "for" };
+      CurrentComm->ForAlls.push_back(Info);
+      return CurrentComm->ForAlls.size() - 1;
+    }
+    void SetForAllLowering(std::size_t Index, const char *Lowering) {
+      if(CurrentComm && Index != std::size_t(-1))
+	CurrentComm->ForAlls[Index].Lowering = Lowering;
+    }
+    void PrintCommReport(llvm::raw_ostream& OS) {
+      OS << "{\n  \"functions\": [";
+      for(std::vector<FunctionComm>::const_iterator iter = CommReport.begin(), end = CommReport.end(); iter != end; ++iter) {
+	unsigned Gets = 0, Puts = 0, Strict = 0, Relaxed = 0, InLoops = 0;
+	uint64_t GetBytes = 0, PutBytes = 0;
+	for(std::vector<CommSite>::const_iterator site = iter->Sites.begin(), site_end = iter->Sites.end(); site != site_end; ++site) {
+	  (site->IsPut? Puts : Gets) += site->Count;
+	  (site->IsPut? PutBytes : GetBytes) += site->Bytes;
+	  (site->Strict? Strict : Relaxed) += site->Count;
+	  if(site->Depth > 0)
+	    InLoops += site->Count;
+	}
+	OS << (iter == CommReport.begin()? "\n" : ",\n") << "    {\"name\": ";
+	PrintJSONString(OS, iter->Name);
+	OS << ", \"line\": " << iter->Line
+	   << ", \"gets\": " << Gets << ", \"get_bytes\": " << GetBytes
+	   << ", \"puts\": " << Puts << ", \"put_bytes\": " << PutBytes
+	   << ", \"strict\": " << Strict << ", \"relaxed\": " << Relaxed
+	   << ", \"in_loops\": " << InLoops << ", \"barriers\": " << iter->Barriers << ",\n";
+	OS << "     \"accesses\": [";
+	for(std::vector<CommSite>::const_iterator site = iter->Sites.begin(), site_end = iter->Sites.end(); site != site_end; ++site) {
+	  OS << (site == iter->Sites.begin()? "" : ", ")
+	     << "{\"line\": " << site->Line << ", \"loop_depth\": " << site->Depth
+	     << ", \"kind\": \"" << (site->IsPut? "put" : "get") << "\", \"strict\": " << (site->Strict? "true" : "false")
+	     << ", \"count\": " << site->Count << ", \"bytes\": " << site->Bytes << "}";
+	}
+	OS << "],\n     \"foralls\": [";
+	for(std::vector<ForAllInfo>::const_iterator loop = iter->ForAlls.begin(), loop_end = iter->ForAlls.end(); loop != loop_end; ++loop) {
+	  OS << (loop == iter->ForAlls.begin()? "" : ", ")
+	     << "{\"line\": " << loop->Line << ", \"loop_depth\": " << loop->Depth
+	     << ", \"affinity\": \"" << loop->Affinity << "\", \"lowering\": \"" << loop->Lowering << "\"}";
+	}
+	OS << "]}";
+      }
+      OS << "\n  ],\n  \"shared_variables\": [";
+      bool First = true;
+      for(SharedGlobalsType::const_iterator iter = SharedGlobals.begin(), end = SharedGlobals.end(); iter != end; ++iter) {
+	if(iter->second->isThisDeclarationADefinition() == VarDecl::DeclarationOnly)
+	  continue;
+	SharedAllocation Alloc = GetSharedAllocation(iter->first, iter->second);
+	int LayoutQualifier = iter->second->getType().getQualifiers().getLayoutQualifier();
+	OS << (First? "\n" : ",\n") << "    {\"name\": ";
+	First = false;
+	PrintJSONString(OS, Alloc.Name);
+	OS << ", \"line\": " << GetLine(iter->second->getLocation())
+	   << ", \"block_size\": " << (LayoutQualifier == 0? "\"indefinite\"" : Twine(LayoutQualifier).str())
+	   << ", \"element_size\": " << Alloc.ElementSize
+	   << ", \"block_bytes\": " << Alloc.BlockBytes;
+	// With THREADS in the dimension every thread gets NumBlocks
+	// blocks.  Otherwise they are dealt out, and the most any
+	// thread gets is only known for a fixed THREADS.
+	uint64_t Threads = Options.StaticThreads;
+	if(Alloc.MultByThreads || Threads || LayoutQualifier == 0) {
+	  uint64_t PerThread = Alloc.MultByThreads || LayoutQualifier == 0? Alloc.NumBlocks : (Alloc.NumBlocks + Threads - 1) / Threads;
+	  OS << ", \"blocks_per_thread\": " << PerThread
+	     << ", \"bytes_per_thread\": " << PerThread * Alloc.BlockBytes;
+	} else {
+	  OS << ", \"total_blocks\": " << Alloc.NumBlocks
+	     << ", \"blocks_per_thread\": null, \"bytes_per_thread\": null";
+	}
+	OS << "}";
+      }
+      OS << "\n  ]\n}\n";
+    }
+    // Statements without UPC can be used as is.  This is only
+    // done for whole statements.  Plain C expressions nested
+    // in UPC expressions still need to be rebuilt, since Sema
+    // can't mix types from the original ASTContext with ours.
+    UPCUsageFinder Usage;
+    bool ReusePlainC;
+    // The body of the function being transformed
+    Stmt *CurrentFunctionBody;
+    bool CurrentFunctionIsMain;
+    StmtResult TransformStmt(Stmt *S) {
+      if(S && ReusePlainC && !Usage.containsUPC(S) && !(DeferringPuts && NeedsPutSync(S)) &&
+	 !(!ForAllExits.empty() && mayJump(S)))
+	return SemaRef.Owned(S);
+      SourceLocation SavedLoc = InstrumentLoc;
+      if(S && S->getLocStart().isValid())
+	InstrumentLoc = S->getLocStart();
+      bool IsLoop = S && (isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) || isa<UPCForAllStmt>(S));
+      LoopDepth += IsLoop;
+      StmtResult Result = TreeTransformUPC::TransformStmt(S);
+      LoopDepth -= IsLoop;
+      InstrumentLoc = SavedLoc;
+      return Result;
+    }
+    // With --instrument, the source position reported for
+    // the accesses of the statement being transformed
+    SourceLocation InstrumentLoc;
+    // Prepends the file and line of InstrumentLoc and the
+    // kind of event to the arguments of an instrumentation hook
+    void AddInstrumentArgs(std::vector<Expr*>& args, int Kind) {
+      PresumedLoc PLoc = SemaRef.getSourceManager().getPresumedLoc(SemaRef.getSourceManager().getExpansionLoc(InstrumentLoc));
+      StringRef File = PLoc.isValid()? PLoc.getFilename() : "";
+      unsigned Line = PLoc.isValid()? PLoc.getLine() : 0;
+      Expr *Head[] = {
+	StringLiteral::Create(SemaRef.Context, File, StringLiteral::Ascii, false, SemaRef.Context.getPointerType(SemaRef.Context.getConstType(SemaRef.Context.CharTy)), SourceLocation()),
+	CreateInteger(SemaRef.Context.IntTy, Line),
+	CreateInteger(SemaRef.Context.IntTy, Kind)
+      };
+      args.insert(args.begin(), Head, Head + 3);
+    }
+    // Calls upcr_notify, upcr_wait or upcr_barrier, or the
+    // hook that reports it with --instrument.
+    Expr *BuildSyncCall(FunctionDecl *Fn, std::vector<Expr*>& args) {
+      if(CurrentComm && Fn != Decls->upcr_wait)
+	++CurrentComm->Barriers;
+      if(!Options.Instrument)
+	return BuildUPCRCall(Fn, args).get();
+      AddInstrumentArgs(args, Fn == Decls->upcr_notify? 0 : Fn == Decls->upcr_wait? 1 : 2);
+      return BuildUPCRCall(Decls->upcrt_gasp_sync, args).get();
+    }
+    // With -fupc-defer-puts, relaxed stores are started with
+    // upcr_nbi_put_(p)shared, the implicit-handle puts of
+    // upcr_nb.h, and completed by upcr_wait_syncnbi_puts at the
+    // next point that can observe them: shared accesses that may
+    // alias a pending put, strict accesses, fences, barriers,
+    // casts to local pointers, calls and returns.  Functions that
+    // may reach a put's target through a local pointer don't
+    // defer their puts.
+    bool DeferringPuts;
+    // Set while transforming code that runs after the last
+    // sync before a call or return
+    bool BlockingPuts;
+    // The puts of a function are divided into classes by the
+    // shared variable that they write, with a NULL class for
+    // puts through pointers.  Each class has a flag that is
+    // set while one of its puts may be pending.
+    std::vector<std::pair<VarDecl*, VarDecl*> > PendingPuts;
+    // The shared variable that the shared lvalue E is part of,
+    // or NULL if E goes through a pointer and may be anywhere.
+    VarDecl *GetAccessClass(Expr *E) {
+      for(;;) {
+	E = E->IgnoreParenImpCasts();
+	if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+	  if(ME->isArrow())
+	    return 0;
+	  E = ME->getBase();
+	} else if(ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(E)) {
+	  // Only a subscript of an array stays inside it
+	  E = Sub->getBase()->IgnoreParenImpCasts();
+	  if(!E->getType()->isArrayType())
+	    return 0;
+	} else {
+	  break;
+	}
+      }
+      DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E);
+      VarDecl *VD = DRE? dyn_cast<VarDecl>(DRE->getDecl()) : 0;
+      if(!VD || !SemaRef.Context.getBaseElementType(VD->getType()).getQualifiers().hasShared())
+	return 0;
+      return VD->getCanonicalDecl();
+    }
+    // Completes the pending puts if a put that may alias an
+    // access to one of Classes is pending.  A NULL class, or no
+    // class at all, may alias any put.  Returns NULL if the
+    // function has no deferred puts.
+    Expr *BuildPutSync(ArrayRef<VarDecl*> Classes = ArrayRef<VarDecl*>()) {
+      bool Any = Classes.empty() || std::find(Classes.begin(), Classes.end(), (VarDecl*)0) != Classes.end();
+      std::vector<Expr*> args;
+      Expr *Sync = BuildUPCRCall(Decls->upcr_wait_syncnbi_puts, args).get();
+      Expr *Test = 0;
+      for(std::vector<std::pair<VarDecl*, VarDecl*> >::const_iterator iter = PendingPuts.begin(), end = PendingPuts.end(); iter != end; ++iter) {
+	if(Any || iter->first == 0 || std::find(Classes.begin(), Classes.end(), iter->first) != Classes.end()) {
+	  Expr *Flag = CreateSimpleDeclRef(iter->second);
+	  Test = Test? SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LOr, Test, Flag).get() : Flag;
+	}
+	// upcr_wait_syncnbi_puts completes all of them
+	Sync = BuildComma(Sync, SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(iter->second), CreateInteger(SemaRef.Context.IntTy, 0)).get()).get();
+      }
+      if(!Test)
+	return 0;
+      return BuildParens(SemaRef.ActOnConditionalOp(SourceLocation(), SourceLocation(), Test, BuildParens(Sync).get(), CreateInteger(SemaRef.Context.IntTy, 0)).get()).get();
+    }
+    Expr *SyncPutsBefore(Expr *E, ArrayRef<VarDecl*> Classes = ArrayRef<VarDecl*>()) {
+      if(!DeferringPuts)
+	return E;
+      Expr *Sync = BuildPutSync(Classes);
+      if(!Sync)
+	return E;
+      return BuildParens(BuildComma(Sync, E).get()).get();
+    }
+    // Marks the puts of Class as possibly pending
+    Expr *BuildSetPending(VarDecl *Class) {
+      std::vector<std::pair<VarDecl*, VarDecl*> >::const_iterator iter = PendingPuts.begin(), end = PendingPuts.end();
+      while(iter != end && iter->first != Class)
+	++iter;
+      assert(iter != end && "store missed by CollectRelaxedStores");
+      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(iter->second), CreateInteger(SemaRef.Context.IntTy, 1)).get();
+    }
+    // Finds the classes and types of the relaxed stores in S
+    void CollectRelaxedStores(Stmt *S, std::vector<VarDecl*>& Classes, std::vector<QualType>& Types) {
+      if(!S) return;
+      Expr *LHS = 0;
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isAssignmentOp())
+	  LHS = BO->getLHS();
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->isIncrementDecrementOp())
+	  LHS = UO->getSubExpr();
+      }
+      if(LHS && LHS->getType().getQualifiers().hasShared() && !LHS->getType().getQualifiers().hasStrict()) {
+	VarDecl *Class = GetAccessClass(LHS);
+	if(std::find(Classes.begin(), Classes.end(), Class) == Classes.end())
+	  Classes.push_back(Class);
+	Types.push_back(LHS->getType().getUnqualifiedType());
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	CollectRelaxedStores(*Children, Classes, Types);
+      }
+    }
+    static bool HasSharedToLocalCast(Stmt *S) {
+      if(!S) return false;
+      if(CastExpr *CE = dyn_cast<CastExpr>(S))
+	if(CE->getCastKind() == CK_UPCSharedToLocal)
+	  return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasSharedToLocalCast(*Children))
+	  return true;
+      }
+      return false;
+    }
+    // Whether an access of type Ty may read or write an
+    // object stored with one of Types.  Character types and
+    // aggregates may overlap anything.
+    bool MayAliasStore(QualType Ty, ArrayRef<QualType> Types) {
+      Ty = SemaRef.Context.getCanonicalType(Ty.getUnqualifiedType());
+      if(Ty->isCharType() || Ty->isRecordType() || Ty->isArrayType())
+	return true;
+      for(ArrayRef<QualType>::iterator iter = Types.begin(), end = Types.end(); iter != end; ++iter) {
+	QualType Stored = SemaRef.Context.getCanonicalType(*iter);
+	if(Stored->isCharType() || Stored->isRecordType() || Stored->isArrayType() || Stored == Ty)
+	  return true;
+      }
+      return false;
+    }
+    // Whether S accesses memory through a local pointer
+    // that may point to the local part of a stored object.
+    // The pointer may have been cast from a pointer-to-shared
+    // anywhere, including in a caller.
+    bool HasAliasingLocalAccess(Stmt *S, ArrayRef<QualType> Types) {
+      if(!S) return false;
+      Expr *Ptr = 0;
+      if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->getOpcode() == UO_Deref)
+	  Ptr = UO->getSubExpr();
+      } else if(ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(S)) {
+	// Subscripts of local arrays don't go through a pointer
+	Expr *Base = Sub->getBase()->IgnoreParenImpCasts();
+	if(!isa<DeclRefExpr>(Base) || !Base->getType()->isArrayType())
+	  Ptr = Sub->getBase();
+      } else if(MemberExpr *ME = dyn_cast<MemberExpr>(S)) {
+	if(ME->isArrow())
+	  Ptr = ME->getBase();
+      }
+      if(Ptr && !isPointerToShared(Ptr->getType()) && MayAliasStore(cast<Expr>(S)->getType(), Types))
+	return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasAliasingLocalAccess(*Children, Types))
+	  return true;
+      }
+      return false;
+    }
+    // Functions that can't see shared memory don't need
+    // the puts to be complete.
+    static bool isKnownLocalFunction(FunctionDecl *FD, SourceManager& SM) {
+      if(FD->getBuiltinID())
+	return true;
+      StringRef Name = FD->getName();
+      return SM.isInSystemHeader(FD->getLocation()) &&
+	!Name.startswith("upc") && !Name.startswith("bupc");
+    }
+    bool NeedsPutSync(Stmt *S) {
+      if(!S) return false;
+      if(isa<ReturnStmt>(S))
+	return true;
+      if(CallExpr *CE = dyn_cast<CallExpr>(S)) {
+	FunctionDecl *Callee = CE->getDirectCallee();
+	if(!Callee || !isKnownLocalFunction(Callee, SemaRef.getSourceManager()))
+	  return true;
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(NeedsPutSync(*Children))
+	  return true;
+      }
+      return false;
+    }
+    ExprResult TransformCallExpr(CallExpr *E) {
+      FunctionDecl *Callee = E->getDirectCallee();
+      if(!DeferringPuts || (Callee && isKnownLocalFunction(Callee, SemaRef.getSourceManager())))
+	return TreeTransformUPC::TransformCallExpr(E);
+      bool SavedBlockingPuts = BlockingPuts;
+      BlockingPuts = true;
+      ExprResult Result = TreeTransformUPC::TransformCallExpr(E);
+      BlockingPuts = SavedBlockingPuts;
+      return SyncPutsBefore(Result.get());
+    }
+    StmtResult TransformReturnStmt(ReturnStmt *S) {
+      if(!DeferringPuts)
+	return BuildForAllJump(TreeTransformUPC::TransformReturnStmt(S), 0);
+      bool SavedBlockingPuts = BlockingPuts;
+      BlockingPuts = true;
+      StmtResult Return = TreeTransformUPC::TransformReturnStmt(S);
+      BlockingPuts = SavedBlockingPuts;
+      SmallVector<Stmt*, 4> Statements;
+      Statements.push_back(BuildPutSync());
+      BuildForAllExits(0, Statements);
+      Statements.push_back(Return.get());
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+    }
     ExprResult BuildParens(Expr * E) {
       return SemaRef.ActOnParenExpr(SourceLocation(), SourceLocation(), E);
     }
@@ -474,7 +1257,11 @@ namespace {
 	  Result.ArrayDimension *= CAT->getSize();
 	} else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
 	  if(TAT->getThread()) {
-	    Result.HasThread = true;
+	    if(Options.StaticThreads) {
+	      Result.ArrayDimension *= llvm::APInt(Result.ArrayDimension.getBitWidth(), Options.StaticThreads);
+	    } else {
+	      Result.HasThread = true;
+	    }
 	  }
 	  Result.ArrayDimension *= TAT->getSize();
 	} else if(const VariableArrayType *VAT = dyn_cast<VariableArrayType>(AT)) {
@@ -501,15 +1288,25 @@ namespace {
       else
 	return BuildParens(E).get();
     }
+    // THREADS, or a constant when compiling for a fixed number of threads
+    Expr *BuildThreads() {
+      if(Options.StaticThreads)
+	return CreateInteger(SemaRef.Context.IntTy, Options.StaticThreads);
+      std::vector<Expr*> args;
+      return BuildUPCRCall(Decls->upcr_threads, args).get();
+    }
+    ExprResult TransformUPCThreadExpr(UPCThreadExpr *E) {
+      if(Options.StaticThreads)
+	return SemaRef.Owned(BuildThreads());
+      return TreeTransformUPC::TransformUPCThreadExpr(E);
+    }
     ExprResult MaybeAdjustForArray(const ArrayDimensionT & Dims, Expr * E, BinaryOperatorKind Op) {
       if(Dims.ArrayDimension == 1 && !Dims.E && !Dims.HasThread) {
 	return SemaRef.Owned(E);
       } else {
 	Expr *Dimension = IntegerLiteral::Create(SemaRef.Context, Dims.ArrayDimension, SemaRef.Context.getSizeType(), SourceLocation());
 	if(Dims.HasThread) {
-	  std::vector<Expr*> args;
-	  Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
-	  Dimension = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Dimension, Threads).get();
+	  Dimension = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Dimension, BuildThreads()).get();
 	}
 	if(Dims.E) {
 	  Dimension = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Dimension, Dims.E).get();
@@ -533,7 +1330,7 @@ namespace {
 	args.push_back(IntegerLiteral::Create(
 	  SemaRef.Context, APInt(32, 1), SemaRef.Context.IntTy, SourceLocation()));
       }
-      Stmt *result = BuildUPCRCall(Decls->upcr_notify, args).get();
+      Stmt *result = SyncPutsBefore(BuildSyncCall(Decls->upcr_notify, args));
       return SemaRef.Owned(result);
     }
     StmtResult TransformUPCWaitStmt(UPCWaitStmt *S) {
@@ -549,7 +1346,7 @@ namespace {
 	args.push_back(IntegerLiteral::Create(
 	  SemaRef.Context, APInt(32, 1), SemaRef.Context.IntTy, SourceLocation()));
       }
-      Stmt *result = BuildUPCRCall(Decls->upcr_wait, args).get();
+      Stmt *result = SyncPutsBefore(BuildSyncCall(Decls->upcr_wait, args));
       return SemaRef.Owned(result);
     }
     StmtResult TransformUPCBarrierStmt(UPCBarrierStmt *S) {
@@ -565,12 +1362,12 @@ namespace {
 	args.push_back(IntegerLiteral::Create(
 	  SemaRef.Context, APInt(32, 1), SemaRef.Context.IntTy, SourceLocation()));
       }
-      Stmt *result = BuildUPCRCall(Decls->upcr_barrier, args).get();
+      Stmt *result = SyncPutsBefore(BuildSyncCall(Decls->upcr_barrier, args));
       return SemaRef.Owned(result);
     }
     StmtResult TransformUPCFenceStmt(UPCFenceStmt *S) {
       std::vector<Expr*> args;
-      Stmt *result = BuildUPCRCall(Decls->upcr_poll, args).get();
+      Stmt *result = SyncPutsBefore(BuildUPCRCall(Decls->upcr_poll, args).get());
       return SemaRef.Owned(result);
     }
     ExprResult TransformInitializer(Expr *Init, bool CXXDirectInit) {
@@ -614,8 +1411,16 @@ namespace {
       }
     }
     ExprResult TransformImplicitCastExpr(ImplicitCastExpr *E) {
-      if(E->getCastKind() == CK_LValueToRValue && E->getSubExpr()->getType().getQualifiers().hasShared()) {
-	return BuildUPCRLoad(TransformExpr(E->getSubExpr()).get(), E->getType().getUnqualifiedType(), E->getSubExpr()->getType());
+      if(E->getCastKind() == CK_LValueToRValue && isPrivatized(E->getSubExpr())) {
+	return SemaRef.DefaultLvalueConversion(BuildPrivateAccess(E->getSubExpr()));
+      } else if(E->getCastKind() == CK_LValueToRValue && isBulkAccess(E->getSubExpr())) {
+	return SemaRef.DefaultLvalueConversion(BuildBulkAccess());
+      } else if(Expr *Value = E->getCastKind() == CK_LValueToRValue? BuildSplitGetUse(E->getSubExpr()) : 0) {
+	return SemaRef.Owned(Value);
+      } else if(CoalescedStruct *Entry = E->getCastKind() == CK_LValueToRValue? FindCoalesced(E->getSubExpr()) : 0) {
+	return SemaRef.DefaultLvalueConversion(BuildCoalescedRead(Entry, E->getSubExpr()));
+      } else if(E->getCastKind() == CK_LValueToRValue && E->getSubExpr()->getType().getQualifiers().hasShared()) {
+	return BuildUPCRLoad(TransformExpr(E->getSubExpr()).get(), E->getType().getUnqualifiedType(), E->getSubExpr()->getType(), E->getSubExpr());
       } else {
 	ExprResult UPCCast = MaybeTransformUPCRCast(E);
 	if(!UPCCast.isInvalid()) {
@@ -637,13 +1442,18 @@ namespace {
     IntegerLiteral *CreateInteger(QualType Ty, int Value) {
       return IntegerLiteral::Create(SemaRef.Context, APInt(SemaRef.Context.getTypeSize(Ty), Value), Ty, SourceLocation());
     }
-    ExprResult BuildUPCRLoad(Expr * E, QualType ResultType, QualType Ty) {
-      std::pair<Expr *, Expr *> LoadAndVar = BuildUPCRLoadParts(E, ResultType, Ty);
+    IntegerLiteral *CreateSize(uint64_t Value) {
+      QualType Ty = SemaRef.Context.getSizeType();
+      return IntegerLiteral::Create(SemaRef.Context, APInt(SemaRef.Context.getTypeSize(Ty), Value), Ty, SourceLocation());
+    }
+    ExprResult BuildUPCRLoad(Expr * E, QualType ResultType, QualType Ty, Expr *Source = 0) {
+      std::pair<Expr *, Expr *> LoadAndVar = BuildUPCRLoadParts(E, ResultType, Ty, Source);
       return BuildParens(BuildComma(LoadAndVar.first, LoadAndVar.second).get());
     }
     // Returns a pair containing the load stmt and a declrefexpr to the
-    // temporary variable created.
-    std::pair<Expr *, Expr *> BuildUPCRLoadParts(Expr * E, QualType ResultType, QualType Ty) {
+    // temporary variable created.  Source is the untransformed
+    // lvalue, if any, which tells which deferred puts it may alias.
+    std::pair<Expr *, Expr *> BuildUPCRLoadParts(Expr * E, QualType ResultType, QualType Ty, Expr *Source = 0) {
       int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
       Qualifiers Quals = Ty.getQualifiers();
       bool Phaseless = isPhaseless(Ty);
@@ -672,7 +1482,19 @@ namespace {
       args.push_back(IntegerLiteral::Create(SemaRef.Context, APInt(SizeTypeSize, 0), SemaRef.Context.getSizeType(), SourceLocation()));
       // size
       args.push_back(IntegerLiteral::Create(SemaRef.Context, APInt(SizeTypeSize, SemaRef.Context.getTypeSizeInChars(ResultType).getQuantity()), SemaRef.Context.getSizeType(), SourceLocation()));
+      NoteAccess(false, Strict, SemaRef.Context.getTypeSizeInChars(ResultType).getQuantity());
+      if(Options.Instrument) {
+	// The hook makes the same get
+	AddInstrumentArgs(args, !Strict);
+	Accessor = Phaseless? Decls->upcrt_gasp_get_pshared : Decls->upcrt_gasp_get_shared;
+      }
       Expr *Load = BuildUPCRCall(Accessor, args).get();
+      if(Strict || !Source) {
+	Load = SyncPutsBefore(Load);
+      } else {
+	VarDecl *Class = GetAccessClass(Source);
+	Load = SyncPutsBefore(Load, Class);
+      }
       return std::make_pair(Load, CreateSimpleDeclRef(TmpVar));
     }
     ExprResult MaybeTransformUPCRCast(CastExpr *E) {
@@ -683,7 +1505,7 @@ namespace {
 	args.push_back(TransformExpr(E->getSubExpr()).get());
 	ExprResult Result = BuildUPCRCall(Accessor, args);
 	TypeSourceInfo *Ty = SemaRef.Context.getTrivialTypeSourceInfo(TransformType(E->getType()));
-	return SemaRef.BuildCStyleCastExpr(SourceLocation(), Ty, SourceLocation(), Result.get());
+	return SyncPutsBefore(SemaRef.BuildCStyleCastExpr(SourceLocation(), Ty, SourceLocation(), Result.get()).get());
       } else if(E->getCastKind() == CK_NullToPointer && isPointerToShared(E->getType())) {
 	bool Phaseless = isPhaseless(E->getType()->getAs<PointerType>()->getPointeeType());
 	return BuildUPCRDeclRef(Phaseless? Decls->upcr_null_pshared : Decls->upcr_null_shared);
@@ -711,7 +1533,8 @@ namespace {
       }
       return ExprError();
     }
-    ExprResult BuildUPCRStore(Expr * LHS, Expr * RHS, QualType Ty, bool ReturnValue = true) {
+    // Source is the untransformed lvalue, as for BuildUPCRLoadParts
+    ExprResult BuildUPCRStore(Expr * LHS, Expr * RHS, QualType Ty, Expr *Source, bool ReturnValue = true) {
       int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
       Qualifiers Quals = Ty.getQualifiers(); 
       bool Phaseless = isPhaseless(Ty);
@@ -721,12 +1544,16 @@ namespace {
       if(Phaseless) {
 	if(Strict) {
 	  Accessor = Decls->UPCR_PUT_PSHARED_STRICT;
+	} else if(DeferringPuts && !BlockingPuts) {
+	  Accessor = Decls->upcr_nbi_put_pshared;
 	} else {
 	  Accessor = Decls->UPCR_PUT_PSHARED;
 	}
       } else {
 	if(Strict) {
 	  Accessor = Decls->UPCR_PUT_SHARED_STRICT;
+	} else if(DeferringPuts && !BlockingPuts) {
+	  Accessor = Decls->upcr_nbi_put_shared;
 	} else {
 	  Accessor = Decls->UPCR_PUT_SHARED;
 	}
@@ -740,7 +1567,22 @@ namespace {
       args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(TmpVar)).get());
       // size
       args.push_back(IntegerLiteral::Create(SemaRef.Context, APInt(SizeTypeSize, SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()), SemaRef.Context.getSizeType(), SourceLocation()));
+      NoteAccess(true, Strict, SemaRef.Context.getTypeSizeInChars(Ty).getQuantity());
+      if(Options.Instrument) {
+	// 0 = strict, 1 = relaxed, 2 = relaxed and non-blocking
+	bool NonBlocking = Accessor == Decls->upcr_nbi_put_pshared || Accessor == Decls->upcr_nbi_put_shared;
+	AddInstrumentArgs(args, Strict? 0 : NonBlocking? 2 : 1);
+	Accessor = Phaseless? Decls->upcrt_gasp_put_pshared : Decls->upcrt_gasp_put_shared;
+      }
       Expr *Store = BuildUPCRCall(Accessor, args).get();
+      if(Strict) {
+	Store = SyncPutsBefore(Store);
+      } else if(DeferringPuts && !BlockingPuts) {
+	// A thread's own writes to one location stay in order,
+	// so wait for any pending put that may write the same one
+	VarDecl *Class = GetAccessClass(Source);
+	Store = BuildComma(SyncPutsBefore(Store, Class), BuildSetPending(Class)).get();
+      }
       Expr *CommaRHS = Store;
       if(ReturnValue) {
 	CommaRHS = BuildComma(Store, CreateSimpleDeclRef(TmpVar)).get();
@@ -761,6 +1603,16 @@ namespace {
 	return BuildUPCRCall(Decls->UPCR_ADD_PSHAREDI, args);
       } else if(isPhaseless(PointeeType) && LayoutQualifier == 1) {
 	return BuildUPCRCall(Decls->UPCR_ADD_PSHARED1, args);
+      } else if(Options.InlinePointerArithmetic) {
+	// The helpers from the prologue only handle steps within
+	// the block themselves, so the C compiler can fold the
+	// constant sizes into that test.
+	if(llvm::isPowerOf2_32(LayoutQualifier)) {
+	  args.push_back(CreateInteger(SemaRef.Context.IntTy, llvm::Log2_32(LayoutQualifier)));
+	  return BuildUPCRCall(Decls->upcrt_add_shared_pow2, args);
+	}
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), LayoutQualifier));
+	return BuildUPCRCall(Decls->upcrt_add_shared_blk, args);
       } else {
 	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), LayoutQualifier));
 	return BuildUPCRCall(Decls->UPCR_ADD_SHARED, args);
@@ -783,22 +1635,24 @@ namespace {
 	// Strip off * and &.  shared lvalues and pointers-to-shared
 	// have the same representation.
 	return TransformExpr(E->getSubExpr());
+      } else if(E->isIncrementDecrementOp() && isPrivatized(E->getSubExpr())) {
+	return SemaRef.CreateBuiltinUnaryOp(SourceLocation(), E->getOpcode(), BuildPrivateAccess(E->getSubExpr()));
       } else if(ArgType.getQualifiers().hasShared() && E->isIncrementDecrementOp()) {
 	bool Phaseless = isPhaseless(ArgType);
 	QualType PtrType = Phaseless? Decls->upcr_pshared_ptr_t : Decls->upcr_shared_ptr_t;
 	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType);
 	Expr * TmpPtr = SemaRef.BuildDeclRefExpr(TmpPtrDecl, PtrType, VK_LValue, SourceLocation()).get();
 	Expr * SaveArg = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr, BuildParens(TransformExpr(E->getSubExpr()).get()).get()).get();
-	std::pair<Expr *, Expr *> Load = BuildUPCRLoadParts(TmpPtr, ArgType.getUnqualifiedType(), ArgType);
+	std::pair<Expr *, Expr *> Load = BuildUPCRLoadParts(TmpPtr, ArgType.getUnqualifiedType(), ArgType, E->getSubExpr());
 	Expr * LoadExpr = Load.first;
 	Expr * LoadVar = Load.second;
 	Expr * NewVal = CreateArithmeticExpr(LoadVar, CreateInteger(SemaRef.Context.IntTy, 1), ArgType, E->isIncrementOp()?BO_Add:BO_Sub).get();
 
 	if(E->isPrefix()) {
-	  Expr * Result = BuildUPCRStore(TmpPtr, NewVal, ArgType).get();
+	  Expr * Result = BuildUPCRStore(TmpPtr, NewVal, ArgType, E->getSubExpr()).get();
 	  return BuildParens(BuildComma(SaveArg, BuildComma(LoadExpr, Result).get()).get());
 	} else {
-	  Expr * Result = BuildUPCRStore(TmpPtr, NewVal, ArgType, false).get();
+	  Expr * Result = BuildUPCRStore(TmpPtr, NewVal, ArgType, E->getSubExpr(), false).get();
 	  return BuildParens(BuildComma(SaveArg, BuildComma(LoadExpr, BuildComma(Result, LoadVar).get()).get()).get());
 	}
       } else if(isPointerToShared(ArgType) && E->isIncrementDecrementOp()) {
@@ -837,10 +1691,15 @@ namespace {
     }
     ExprResult TransformBinaryOperator(BinaryOperator *E) {
       // Catch assignment to shared variables
-      if(E->getOpcode() == BO_Assign && E->getLHS()->getType().getQualifiers().hasShared()) {
+      if(E->getOpcode() == BO_Assign && isBulkAccess(E->getLHS())) {
+	return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildBulkAccess(), TransformExpr(E->getRHS()).get());
+      } else if(E->getOpcode() == BO_Assign && isPrivatized(E->getLHS())) {
+	Expr *LHS = BuildPrivateAccess(E->getLHS());
+	return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LHS, TransformExpr(E->getRHS()).get());
+      } else if(E->getOpcode() == BO_Assign && E->getLHS()->getType().getQualifiers().hasShared()) {
 	Expr *LHS = TransformExpr(E->getLHS()).get();
 	Expr *RHS = TransformExpr(E->getRHS()).get();
-	return BuildUPCRStore(LHS, RHS, E->getLHS()->getType());
+	return BuildUPCRStore(LHS, RHS, E->getLHS()->getType(), E->getLHS());
       } else {
 	Expr *LHS = E->getLHS();
 	Expr *RHS = E->getRHS();
@@ -920,7 +1779,10 @@ namespace {
       return TreeTransformUPC::TransformBinaryOperator(E);
     }
     ExprResult TransformCompoundAssignOperator(CompoundAssignOperator *E) {
-      if(E->getLHS()->getType().getQualifiers().hasShared()) {
+      if(isPrivatized(E->getLHS())) {
+	Expr *LHS = BuildPrivateAccess(E->getLHS());
+	return SemaRef.CreateBuiltinBinOp(SourceLocation(), E->getOpcode(), LHS, TransformExpr(E->getRHS()).get());
+      } else if(E->getLHS()->getType().getQualifiers().hasShared()) {
 	QualType Ty = E->getLHS()->getType();
 	bool Phaseless = isPhaseless(Ty);
 	QualType PtrType = Phaseless? Decls->upcr_pshared_ptr_t : Decls->upcr_shared_ptr_t;
@@ -929,9 +1791,9 @@ namespace {
 	Expr * TmpPtr = SemaRef.BuildDeclRefExpr(TmpPtrDecl, PtrType, VK_LValue, SourceLocation()).get();
 	Expr * SaveLHS = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr, BuildParens(TransformExpr(E->getLHS()).get()).get()).get();
 	Expr * RHS = BuildParens(TransformExpr(E->getRHS()).get()).get();
-	Expr * LHSVal = BuildUPCRLoad(TmpPtr, Ty.getUnqualifiedType(), Ty).get();
+	Expr * LHSVal = BuildUPCRLoad(TmpPtr, Ty.getUnqualifiedType(), Ty, E->getLHS()).get();
 	Expr * OpResult = CreateArithmeticExpr(LHSVal, RHS, Ty, Opc).get();
-	Expr * Result = BuildUPCRStore(TmpPtr, OpResult, Ty).get();
+	Expr * Result = BuildUPCRStore(TmpPtr, OpResult, Ty, E->getLHS()).get();
 	return BuildParens(BuildComma(SaveLHS, Result).get());
       }	else if(isPointerToShared(E->getLHS()->getType())) {
 	QualType Ty = E->getLHS()->getType();
@@ -951,27 +1813,13 @@ namespace {
       }
     }
     ExprResult TransformArraySubscriptExpr(ArraySubscriptExpr *E) {
-      if(isPointerToShared(E->getBase()->getType())) {
+      if(VarDecl *Ptr = FindInductionPointer(E)) {
+	return SemaRef.Owned(CreateSimpleDeclRef(Ptr));
+      } else if(isPointerToShared(E->getBase()->getType())) {
 	Expr *LHS = E->getBase();
 	Expr *RHS = E->getIdx();
-	QualType PointeeType = LHS->getType()->getAs<PointerType>()->getPointeeType();
-	ArrayDimensionT Dims = GetArrayDimension(PointeeType);
-	int ElementSize = Dims.ElementSize;
-	Expr *IntVal = TransformExpr(RHS).get();
-	IntVal = MaybeAdjustForArray(Dims, IntVal, BO_Mul).get();
-	std::vector<Expr*> args;
-	args.push_back(TransformExpr(LHS).get());
-	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElementSize));
-	args.push_back(IntVal);
-	int LayoutQualifier = PointeeType.getQualifiers().getLayoutQualifier();
-	if(LayoutQualifier == 0) {
-	  return BuildUPCRCall(Decls->UPCR_ADD_PSHAREDI, args);
-	} else if(LayoutQualifier == 1) {
-	  return BuildUPCRCall(Decls->UPCR_ADD_PSHARED1, args);
-	} else {
-	  args.push_back(CreateInteger(SemaRef.Context.getSizeType(), LayoutQualifier));
-	  return BuildUPCRCall(Decls->UPCR_ADD_SHARED, args);
-	}
+	Expr *Base = TransformExpr(LHS).get();
+	return CreateUPCPointerArithmetic(Base, TransformExpr(RHS).get(), LHS->getType());
       } else {
 	return TreeTransformUPC::TransformArraySubscriptExpr(E);
       }
@@ -1026,7 +1874,100 @@ namespace {
 	return TreeTransformUPC::TransformUnaryExprOrTypeTraitExpr(E);
       }
     }
+    // With --instrument, a return or goto that leaves a
+    // upc_forall has to report the end of the loop and clear
+    // upcrt_forall_control itself.  Active is set while this
+    // thread runs the iterations with its affinity.
+    struct ForAllExit {
+      UPCForAllStmt *Loop;
+      VarDecl *Active;
+    };
+    std::vector<ForAllExit> ForAllExits;
+    // The Active flags of the function, which start cleared
+    std::vector<VarDecl*> ForAllFlags;
     StmtResult TransformUPCForAllStmt(UPCForAllStmt *S) {
+      if(!Options.Instrument || !S->getAfnty())
+	return TransformUPCForAllLoop(S, 0);
+      ForAllExit Exit = { S, CreateFunctionTmpVar(SemaRef.Context.IntTy) };
+      ForAllFlags.push_back(Exit.Active);
+      ForAllExits.push_back(Exit);
+      StmtResult Result = TransformUPCForAllLoop(S, Exit.Active);
+      ForAllExits.pop_back();
+      return Result;
+    }
+    // Adds the statements that end the instrumented loops
+    // inside the first Outer ones, innermost first.
+    void BuildForAllExits(std::size_t Outer, SmallVectorImpl<Stmt*>& Statements) {
+      SourceLocation SavedLoc = InstrumentLoc;
+      for(std::vector<ForAllExit>::const_reverse_iterator iter = ForAllExits.rbegin(), end = ForAllExits.rend() - Outer; iter != end; ++iter) {
+	// if(active) { active = 0; end event; upcrt_forall_control = 0; }
+	SmallVector<Stmt*, 4> End;
+	{
+	  Sema::CompoundScopeRAII BodyScope(SemaRef);
+	  End.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(iter->Active), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	  InstrumentLoc = iter->Loop->getLocStart();
+	  std::vector<Expr*> args;
+	  AddInstrumentArgs(args, 0);
+	  End.push_back(BuildUPCRCall(Decls->upcrt_gasp_forall, args).get());
+	  End.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildUPCRDeclRef(Decls->upcrt_forall_control).get(), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	}
+	StmtResult EndBlock = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), End, false);
+	Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(CreateSimpleDeclRef(iter->Active)), NULL, EndBlock.get(), SourceLocation(), NULL).get());
+      }
+      InstrumentLoc = SavedLoc;
+    }
+    static bool ContainsStmt(Stmt *S, Stmt *Target) {
+      if(!S) return false;
+      if(S == Target)
+	return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(ContainsStmt(*Children, Target))
+	  return true;
+      }
+      return false;
+    }
+    static bool HasLabel(Stmt *S) {
+      if(!S) return false;
+      if(isa<LabelStmt>(S))
+	return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasLabel(*Children))
+	  return true;
+      }
+      return false;
+    }
+    StmtResult BuildForAllJump(StmtResult Jump, std::size_t Outer) {
+      SmallVector<Stmt*, 4> Statements;
+      BuildForAllExits(Outer, Statements);
+      if(Statements.empty())
+	return Jump;
+      Statements.push_back(Jump.get());
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+    }
+    StmtResult TransformGotoStmt(GotoStmt *S) {
+      StmtResult Result = TreeTransformUPC::TransformGotoStmt(S);
+      if(ForAllExits.empty())
+	return Result;
+      // The loops around the label keep running
+      std::size_t Outer = ForAllExits.size();
+      while(Outer > 0 && !ContainsStmt(ForAllExits[Outer - 1].Loop->getBody(), S->getLabel()->getStmt()))
+	--Outer;
+      return BuildForAllJump(Result, Outer);
+    }
+    StmtResult TransformIndirectGotoStmt(IndirectGotoStmt *S) {
+      StmtResult Result = TreeTransformUPC::TransformIndirectGotoStmt(S);
+      if(ForAllExits.empty())
+	return Result;
+      // The target is unknown, but it can only be
+      // inside the loops that have labels.
+      std::size_t Outer = ForAllExits.size();
+      while(Outer > 0 && !HasLabel(ForAllExits[Outer - 1].Loop->getBody()))
+	--Outer;
+      return BuildForAllJump(Result, Outer);
+    }
+    StmtResult TransformUPCForAllLoop(UPCForAllStmt *S, VarDecl *Active) {
+      std::size_t ForAllIndex = NoteForAll(S);
       // Transform the initialization statement
       StmtResult Init = getDerived().TransformStmt(S->getInit());
 
@@ -1073,6 +2014,42 @@ namespace {
 	return PlainFor;
       }
 
+      // The body of the loop that only runs iterations with our affinity
+      Stmt *UPCBodyStmt = Body.get();
+      if(Options.PrivatizeForAll) {
+	StmtResult Private = TransformPrivatizedBody(S);
+	if(Private.isUsable())
+	  UPCBodyStmt = Private.get();
+      }
+
+      SmallVector<Stmt*, 8> Statements;
+      CountedLoop Loop;
+      if(Options.StridedForAll && !ConditionVar &&
+	 GetCountedLoop(S->getInit(), S->getCond(), S->getInc(), S->getBody(), Loop)) {
+	int64_t Offset;
+	VarDecl *Array;
+	uint64_t Rows;
+	bool Signed = Loop.Var->getType()->isSignedIntegerType();
+	if(!isPointerToShared(S->getAfnty()->getType())) {
+	  if(GetAffineAffinity(S->getAfnty(), Loop.Var, Offset) && (Offset >= 0 || Signed)) {
+	    SetForAllLowering(ForAllIndex, "strided");
+	    BuildStridedForAll(Loop, Offset, Init.get(), UPCBodyStmt, Statements);
+	    return BuildForAllWrapper(PlainFor.get(), Statements, Active);
+	  }
+	} else if(GetArrayAffinity(S->getAfnty(), Loop.Var, Array, Offset) && (Offset >= 0 || Signed) &&
+		  GetRowsPerBlock(Array, Rows)) {
+	  SetForAllLowering(ForAllIndex, Rows == 0? "indefinite" : Rows == 1? "strided" : "blocked");
+	  if(Rows == 0) {
+	    BuildIndefiniteForAll(Loop, Init.get(), FullCond.get(), FullInc.get(), UPCBodyStmt, Statements);
+	  } else if(Rows == 1) {
+	    BuildStridedForAll(Loop, Offset, Init.get(), UPCBodyStmt, Statements);
+	  } else {
+	    BuildBlockedForAll(Loop, Offset, Rows, Init.get(), FullCond.get(), UPCBodyStmt, Statements);
+	  }
+	  return BuildForAllWrapper(PlainFor.get(), Statements, Active);
+	}
+      }
+
       ExprResult Afnty = TransformExpr(S->getAfnty());
       ExprResult ThreadTest;
       if(isPointerToShared(S->getAfnty()->getType())) {
@@ -1082,71 +2059,1550 @@ namespace {
 	ThreadTest = BuildUPCRCall(Phaseless?Decls->upcr_hasMyAffinity_pshared:Decls->upcr_hasMyAffinity_shared, args);
       } else {
 	std::vector<Expr*> args;
-	Expr * Affinity = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Afnty.get()).get(), BuildUPCRCall(Decls->upcr_threads, args).get()).get();
+	Expr * Affinity = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Afnty.get()).get(), BuildThreads()).get();
 	ThreadTest = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, Affinity, BuildUPCRCall(Decls->upcr_mythread, args).get());
       }
 
-      StmtResult UPCBody = SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(ThreadTest.get()), NULL, Body.get(), SourceLocation(), NULL);
+      StmtResult UPCBody = SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(ThreadTest.get()), NULL, UPCBodyStmt, SourceLocation(), NULL);
+      SetForAllLowering(ForAllIndex, "affinity_test");
 
       StmtResult UPCFor = SemaRef.ActOnForStmt(S->getForLoc(), S->getLParenLoc(),
 						 Init.get(), FullCond, ConditionVar,
 						 FullInc, S->getRParenLoc(), UPCBody.get());
 
+      Statements.push_back(UPCFor.get());
+      return BuildForAllWrapper(PlainFor.get(), Statements, Active);
+    }
+    // Nested upc_forall loops run every iteration, so
+    // if(upcrt_forall_control) PlainFor
+    // else { upcrt_forall_control = 1; Loop; upcrt_forall_control = 0; }
+    StmtResult BuildForAllWrapper(Stmt *PlainFor, ArrayRef<Stmt*> Loop, VarDecl *Active) {
       StmtResult UPCForWrapper;
       {
 	Sema::CompoundScopeRAII BodyScope(SemaRef);
 	SmallVector<Stmt*, 8> Statements;
 	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildUPCRDeclRef(Decls->upcrt_forall_control).get(), CreateInteger(SemaRef.Context.IntTy, 1)).get());
-	Statements.push_back(UPCFor.get());
+	if(Options.Instrument) {
+	  std::vector<Expr*> args;
+	  AddInstrumentArgs(args, 1);
+	  Statements.push_back(BuildUPCRCall(Decls->upcrt_gasp_forall, args).get());
+	  Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Active), CreateInteger(SemaRef.Context.IntTy, 1)).get());
+	}
+	Statements.append(Loop.begin(), Loop.end());
+	if(Options.Instrument) {
+	  Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Active), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	  std::vector<Expr*> args;
+	  AddInstrumentArgs(args, 0);
+	  Statements.push_back(BuildUPCRCall(Decls->upcrt_gasp_forall, args).get());
+	}
 	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildUPCRDeclRef(Decls->upcrt_forall_control).get(), CreateInteger(SemaRef.Context.IntTy, 0)).get());
 
 	UPCForWrapper = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
       }
 
-      return SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(BuildUPCRDeclRef(Decls->upcrt_forall_control).get()), NULL, PlainFor.get(), SourceLocation(), UPCForWrapper.get());
+      return SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(BuildUPCRDeclRef(Decls->upcrt_forall_control).get()), NULL, PlainFor, SourceLocation(), UPCForWrapper.get());
     }
-    ExprResult TransformCondition(Expr *E) {
-      ExprResult Result = TransformExpr(E);
-      if(isPointerToShared(E->getType())) {
-	bool Phaseless = isPhaseless(E->getType()->getAs<PointerType>()->getPointeeType());
-	std::vector<Expr*> args;
-	args.push_back(Result.get());
-	ExprResult Test = BuildUPCRCall(Phaseless?Decls->UPCR_ISNULL_PSHARED:Decls->UPCR_ISNULL_SHARED, args);
-	return SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_LNot, Test.get());
-      } else {
-	return Result;
+    // A loop of the form for(i = lo; i < hi; ++i) (or i <= hi)
+    // where the body can't change i or hi and doesn't jump out
+    // of the loop except by return.  Skipping iterations of such
+    // a loop that do nothing doesn't change its behavior.
+    struct CountedLoop {
+      VarDecl *Var;
+      Expr *Upper;
+      bool Inclusive;
+      bool DeclaredInInit;
+    };
+    struct LoopBodyInfo {
+      LoopBodyInfo() : HasBreak(false), HasJump(false) {}
+      std::set<VarDecl*> Modified;
+      bool HasBreak;
+      bool HasJump;
+    };
+    static VarDecl *getReferencedVar(Expr *E) {
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+	return dyn_cast<VarDecl>(DRE->getDecl());
+      return 0;
+    }
+    void ScanLoopBody(Stmt *S, LoopBodyInfo& Info, bool InBreakable) {
+      if(!S) return;
+      if(isa<BreakStmt>(S) && !InBreakable) {
+	Info.HasBreak = true;
+      } else if(isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) || isa<LabelStmt>(S)) {
+	Info.HasJump = true;
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isAssignmentOp())
+	  if(VarDecl *VD = getReferencedVar(BO->getLHS()))
+	    Info.Modified.insert(VD);
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf)
+	  if(VarDecl *VD = getReferencedVar(UO->getSubExpr()))
+	    Info.Modified.insert(VD);
+      } else if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	// Their values don't exist before the declaration,
+	// so nothing that uses them can be moved above it
+	for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+	  if(VarDecl *VD = dyn_cast<VarDecl>(*iter))
+	    Info.Modified.insert(VD);
+	}
+      }
+      bool Breakable = InBreakable || isa<ForStmt>(S) || isa<WhileStmt>(S) ||
+	isa<DoStmt>(S) || isa<SwitchStmt>(S) || isa<UPCForAllStmt>(S);
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	ScanLoopBody(*Children, Info, Breakable);
       }
     }
-    StmtResult TransformIfStmt(IfStmt *S) {
-      // Transform the condition
-      ExprResult Cond;
-      VarDecl *ConditionVar = 0;
-      if (S->getConditionVariable()) {
-	ConditionVar
-	  = cast_or_null<VarDecl>(
-                       getDerived().TransformDefinition(
-                                          S->getConditionVariable()->getLocation(),
-                                                        S->getConditionVariable()));
-	if (!ConditionVar)
-	  return StmtError();
+    static bool hasAddressOf(Stmt *S, VarDecl *VD) {
+      if(!S) return false;
+      if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S))
+	if(UO->getOpcode() == UO_AddrOf && getReferencedVar(UO->getSubExpr()) == VD)
+	  return true;
+      // Arrays decay to pointers
+      if(ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S))
+	if(ICE->getCastKind() == CK_ArrayToPointerDecay && getReferencedVar(ICE->getSubExpr()) == VD)
+	  return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(hasAddressOf(*Children, VD))
+	  return true;
+      }
+      return false;
+    }
+    // A local variable that nothing else can modify behind our back
+    bool isPrivateLocal(VarDecl *VD) {
+      return VD && VD->hasLocalStorage() && !VD->getType().isVolatileQualified() &&
+	!hasAddressOf(CurrentFunctionBody, VD);
+    }
+    static void CollectReferencedVars(Stmt *S, std::set<VarDecl*>& Vars) {
+      if(!S) return;
+      if(VarDecl *VD = isa<Expr>(S)? getReferencedVar(cast<Expr>(S)) : 0)
+	Vars.insert(VD);
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	CollectReferencedVars(*Children, Vars);
+      }
+    }
+    // Whether E always has the same value while Body runs
+    bool isLoopInvariant(Expr *E, const LoopBodyInfo& Info) {
+      std::set<VarDecl*> Vars;
+      CollectReferencedVars(E, Vars);
+      for(std::set<VarDecl*>::const_iterator iter = Vars.begin(), end = Vars.end(); iter != end; ++iter) {
+	if(Info.Modified.count(*iter) ||
+	   !(isPrivateLocal(*iter) || (*iter)->getType().isConstQualified()))
+	  return false;
+      }
+      return true;
+    }
+    bool GetCountedLoop(Stmt *Init, Expr *Cond, Expr *Inc, Stmt *Body, CountedLoop& Result) {
+      if(!Init || !Cond || !Inc)
+	return false;
+      // Init
+      VarDecl *Var = 0;
+      if(DeclStmt *DS = dyn_cast<DeclStmt>(Init)) {
+	if(!DS->isSingleDecl())
+	  return false;
+	Var = dyn_cast<VarDecl>(DS->getSingleDecl());
+	if(!Var || !Var->getInit())
+	  return false;
+	Result.DeclaredInInit = true;
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(Init)) {
+	if(BO->getOpcode() != BO_Assign)
+	  return false;
+	Var = getReferencedVar(BO->getLHS());
+	Result.DeclaredInInit = false;
+      }
+      if(!Var || !Var->getType()->isIntegerType() || !isPrivateLocal(Var))
+	return false;
+      // Condition
+      BinaryOperator *Test = dyn_cast<BinaryOperator>(Cond->IgnoreParenImpCasts());
+      if(!Test || (Test->getOpcode() != BO_LT && Test->getOpcode() != BO_LE) ||
+	 getReferencedVar(Test->getLHS()) != Var)
+	return false;
+      Result.Upper = Test->getRHS();
+      Result.Inclusive = Test->getOpcode() == BO_LE;
+      // Increment
+      Expr *Step = Inc->IgnoreParenImpCasts();
+      if(UnaryOperator *UO = dyn_cast<UnaryOperator>(Step)) {
+	if(!UO->isIncrementOp() || getReferencedVar(UO->getSubExpr()) != Var)
+	  return false;
+      } else if(CompoundAssignOperator *CAO = dyn_cast<CompoundAssignOperator>(Step)) {
+	llvm::APSInt Value;
+	if(CAO->getOpcode() != BO_AddAssign || getReferencedVar(CAO->getLHS()) != Var ||
+	   !CAO->getRHS()->EvaluateAsInt(Value, SemaRef.Context) || Value != 1)
+	  return false;
       } else {
-	Cond = TransformCondition(S->getCond());
-	
-	if (Cond.isInvalid())
-	  return StmtError();
-	
-	// Convert the condition to a boolean value.
-	if (S->getCond()) {
-	  ExprResult CondE = getSema().ActOnBooleanCondition(0, S->getIfLoc(),
-							     Cond.get());
-	  if (CondE.isInvalid())
-	    return StmtError();
-	  
-	  Cond = CondE.get();
-	}
+	return false;
       }
-      
-      Sema::FullExprArg FullCond(getSema().MakeFullExpr(Cond.take()));
+      // Skipping an iteration skips evaluating the condition,
+      // so it can't have side effects.
+      UPCUsageFinder Finder;
+      if(Result.Upper->HasSideEffects(SemaRef.Context) || Finder.mark(Result.Upper))
+	return false;
+      // Body.  The final value of i is only recomputed
+      // correctly if the bound doesn't change.
+      LoopBodyInfo Info;
+      ScanLoopBody(Body, Info, false);
+      if(Info.HasBreak || Info.HasJump || Info.Modified.count(Var) ||
+	 (!Result.DeclaredInInit && !isLoopInvariant(Result.Upper, Info)))
+	return false;
+      Result.Var = Var;
+      return true;
+    }
+    // Matches an affinity expression of the form i + c
+    bool GetAffineAffinity(Expr *Afnty, VarDecl *Var, int64_t& Offset) {
+      Expr *E = Afnty->IgnoreParenImpCasts();
+      if(getReferencedVar(E) == Var) {
+	Offset = 0;
+	return true;
+      }
+      BinaryOperator *BO = dyn_cast<BinaryOperator>(E);
+      if(!BO || (BO->getOpcode() != BO_Add && BO->getOpcode() != BO_Sub))
+	return false;
+      Expr *VarSide = BO->getLHS();
+      Expr *ConstSide = BO->getRHS();
+      if(BO->getOpcode() == BO_Add && getReferencedVar(VarSide) != Var)
+	std::swap(VarSide, ConstSide);
+      llvm::APSInt Value;
+      if(getReferencedVar(VarSide) != Var || !ConstSide->EvaluateAsInt(Value, SemaRef.Context))
+	return false;
+      Offset = BO->getOpcode() == BO_Sub? -Value.getSExtValue() : Value.getSExtValue();
+      return true;
+    }
+    // Matches an affinity expression of the form &a[i + c] or a + (i + c)
+    // where a is a shared array.
+    bool GetArrayAffinity(Expr *Afnty, VarDecl *Var, VarDecl *&Array, int64_t& Offset) {
+      Expr *Index;
+      return GetArrayAndIndex(Afnty, Array, Index) &&
+	GetAffineAffinity(Index, Var, Offset);
+    }
+    // Splits &a[idx] or a + idx into a and idx
+    bool GetArrayAndIndex(Expr *Afnty, VarDecl *&Array, Expr *&Index) {
+      Expr *E = Afnty->IgnoreParenImpCasts();
+      Expr *Base = 0;
+      if(UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+	if(UO->getOpcode() != UO_AddrOf)
+	  return false;
+	ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(UO->getSubExpr()->IgnoreParens());
+	if(!Sub)
+	  return false;
+	Base = Sub->getBase();
+	Index = Sub->getIdx();
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+	if(BO->getOpcode() != BO_Add)
+	  return false;
+	Base = BO->getLHS();
+	Index = BO->getRHS();
+	if(!Base->getType()->isPointerType())
+	  std::swap(Base, Index);
+      } else {
+	return false;
+      }
+      Array = getReferencedVar(Base);
+      return Array && Array->getType()->isArrayType();
+    }
+    // The number of elements of the outermost dimension of a that
+    // have the same affinity.  0 means that the whole array belongs
+    // to thread 0.
+    bool GetRowsPerBlock(VarDecl *Array, uint64_t& Rows) {
+      QualType Ty = Array->getType();
+      if(!Ty.getQualifiers().hasShared())
+	return false;
+      const ArrayType *AT = SemaRef.Context.getAsArrayType(Ty);
+      if(!AT || isa<VariableArrayType>(AT))
+	return false;
+      ArrayDimensionT Dims = GetArrayDimension(AT->getElementType());
+      if(Dims.E || Dims.HasThread || Dims.ArrayDimension == 0)
+	return false;
+      uint64_t RowSize = Dims.ArrayDimension.getZExtValue();
+      uint64_t Layout = Ty.getQualifiers().getLayoutQualifier();
+      if(Layout == 0) {
+	Rows = 0;
+	return true;
+      }
+      // A row that spans several blocks belongs to more than one thread
+      if(Layout % RowSize != 0)
+	return false;
+      Rows = Layout / RowSize;
+      return true;
+    }
+    Expr *BuildAddConstant(Expr *E, int64_t Value) {
+      if(Value == 0)
+	return E;
+      BinaryOperatorKind Op = Value < 0? BO_Sub : BO_Add;
+      Expr *Abs = CreateInteger(SemaRef.Context.IntTy, (int)(Value < 0? -Value : Value));
+      return BuildParens(SemaRef.CreateBuiltinBinOp(SourceLocation(), Op, E, Abs).get()).get();
+    }
+    Expr *BuildIntConstant(int64_t Value) {
+      Expr *Abs = CreateInteger(SemaRef.Context.IntTy, (int)(Value < 0? -Value : Value));
+      if(Value < 0)
+	return SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Minus, Abs).get();
+      return Abs;
+    }
+    Expr *BuildIntCast(Expr *E) {
+      TypeSourceInfo *IntTy = SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy);
+      return SemaRef.BuildCStyleCastExpr(SourceLocation(), IntTy, SourceLocation(), BuildParens(E).get()).get();
+    }
+    // (upcr_mythread() - (int)(E % THREADS) + THREADS) % THREADS
+    // i.e. the distance from E to the next value with our affinity
+    Expr *BuildDistanceToMyThread(Expr *E) {
+      std::vector<Expr*> args;
+      Expr *Rem = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, E, BuildThreads()).get();
+      Expr *Diff = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, BuildUPCRCall(Decls->upcr_mythread, args).get(), BuildIntCast(Rem)).get();
+      Diff = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Diff, BuildThreads()).get();
+      return BuildParens(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Diff).get(), BuildThreads()).get()).get();
+    }
+    // Emits init and saves the starting value of i.  If Clamp
+    // is set, i + c is made non-negative, since (i + c) % THREADS
+    // never equals MYTHREAD for negative values.
+    VarDecl *BuildCountedLoopPrologue(const CountedLoop& Loop, int64_t Offset, bool Clamp, Stmt *Init, SmallVectorImpl<Stmt*>& Statements) {
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      QualType VarTy = Var->getType().getUnqualifiedType();
+      Statements.push_back(Init);
+      VarDecl *Saved = 0;
+      if(!Loop.DeclaredInInit) {
+	Saved = CreateTmpVar(VarTy);
+	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Saved), CreateSimpleDeclRef(Var)).get());
+      }
+      if(Clamp && VarTy->isSignedIntegerType()) {
+	Expr *Negative = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, BuildAddConstant(CreateSimpleDeclRef(Var), Offset), CreateInteger(SemaRef.Context.IntTy, 0)).get();
+	Expr *Start = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Var), BuildIntConstant(-Offset)).get();
+	Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(Negative), NULL, Start, SourceLocation(), NULL).get());
+      }
+      return Saved;
+    }
+    // i = saved < hi? hi : saved;
+    // gives i the value that the original loop leaves it with.
+    // It isn't needed if i is local to the loop.
+    void BuildCountedLoopEpilogue(const CountedLoop& Loop, VarDecl *Saved, SmallVectorImpl<Stmt*>& Statements) {
+      if(!Saved)
+	return;
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      Expr *End = TransformExpr(Loop.Upper).get();
+      if(Loop.Inclusive)
+	End = BuildAddConstant(End, 1);
+      Expr *Ran = SemaRef.CreateBuiltinBinOp(SourceLocation(), Loop.Inclusive? BO_LE : BO_LT, CreateSimpleDeclRef(Saved), BuildParens(TransformExpr(Loop.Upper).get()).get()).get();
+      Expr *Final = SemaRef.ActOnConditionalOp(SourceLocation(), SourceLocation(), Ran, End, CreateSimpleDeclRef(Saved)).get();
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Var), Final).get());
+    }
+    // Lowers upc_forall(init; i < hi; i++; i + c) to
+    //   init;
+    //   d = distance from i + c to MYTHREAD;
+    //   for(; i < hi - d; d = THREADS) { i += d; body; }
+    // instead of testing the affinity on every iteration.
+    // Testing against hi - d before stepping keeps i from
+    // overflowing when hi is within THREADS of its maximum.
+    void BuildStridedForAll(const CountedLoop& Loop, int64_t Offset, Stmt *Init, Stmt *Body, SmallVectorImpl<Stmt*>& Statements) {
+      VarDecl *Saved = BuildCountedLoopPrologue(Loop, Offset, true, Init, Statements);
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      VarDecl *Step = CreateTmpVar(SemaRef.Context.IntTy);
+      Expr *Skip = BuildDistanceToMyThread(BuildAddConstant(CreateSimpleDeclRef(Var), Offset));
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Step), Skip).get());
+      Expr *Last = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, BuildParens(TransformExpr(Loop.Upper).get()).get(), CreateSimpleDeclRef(Step)).get();
+      Expr *Cond = SemaRef.CreateBuiltinBinOp(SourceLocation(), Loop.Inclusive? BO_LE : BO_LT, CreateSimpleDeclRef(Var), Last).get();
+      // hi - d wraps around if it is unsigned
+      if(Last->getType()->isUnsignedIntegerType()) {
+	Expr *Room = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_GE, BuildParens(TransformExpr(Loop.Upper).get()).get(), CreateSimpleDeclRef(Step)).get();
+	Cond = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LAnd, Room, Cond).get();
+      }
+      Expr *Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Step), BuildThreads()).get();
+      SmallVector<Stmt*, 2> Stepped;
+      {
+	Sema::CompoundScopeRAII BodyScope(SemaRef);
+	Stepped.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_AddAssign, CreateSimpleDeclRef(Var), CreateSimpleDeclRef(Step)).get());
+	Stepped.push_back(Body);
+      }
+      StmtResult SteppedBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Stepped, false);
+      Statements.push_back(SemaRef.ActOnForStmt(SourceLocation(), SourceLocation(), NULL, SemaRef.MakeFullExpr(Cond), NULL,
+						SemaRef.MakeFullExpr(Inc), SourceLocation(), SteppedBody.get()).get());
+      BuildCountedLoopEpilogue(Loop, Saved, Statements);
+    }
+    // Lowers upc_forall(init; i < hi; i++; &a[i + c]) where
+    // a has B rows per block to
+    //   init;
+    //   while(i < hi) {
+    //     blk = (i + c) / B;
+    //     blk += distance from blk to MYTHREAD;
+    //     if(i + c < blk * B) i = blk * B - c;
+    //     end = (blk + 1) * B - c;
+    //     for(; i < end && i < hi; ++i) body;
+    //   }
+    // so that each thread only visits the blocks that it owns.
+    void BuildBlockedForAll(const CountedLoop& Loop, int64_t Offset, uint64_t BlockSize, Stmt *Init, Expr *Cond, Stmt *Body, SmallVectorImpl<Stmt*>& Statements) {
+      VarDecl *Saved = BuildCountedLoopPrologue(Loop, Offset, true, Init, Statements);
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      QualType VarTy = Var->getType().getUnqualifiedType();
+      VarDecl *Block = CreateTmpVar(VarTy);
+      VarDecl *End = CreateTmpVar(VarTy);
+      Expr *B = CreateInteger(SemaRef.Context.IntTy, (int)BlockSize);
+      SmallVector<Stmt*, 8> Outer;
+      {
+	Sema::CompoundScopeRAII BodyScope(SemaRef);
+	Expr *Index = BuildAddConstant(CreateSimpleDeclRef(Var), Offset);
+	Outer.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Block),
+						   SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Div, Index, B).get()).get());
+	Outer.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_AddAssign, CreateSimpleDeclRef(Block),
+						   BuildDistanceToMyThread(CreateSimpleDeclRef(Block))).get());
+	Expr *BlockStart = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, CreateSimpleDeclRef(Block), B).get();
+	Expr *Before = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, BuildAddConstant(CreateSimpleDeclRef(Var), Offset), BlockStart).get();
+	BlockStart = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, CreateSimpleDeclRef(Block), B).get();
+	Expr *Skip = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Var), BuildAddConstant(BlockStart, -Offset)).get();
+	Outer.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(Before), NULL, Skip, SourceLocation(), NULL).get());
+	Expr *NextBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, CreateSimpleDeclRef(Block), CreateInteger(SemaRef.Context.IntTy, 1)).get();
+	Expr *BlockEnd = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, BuildParens(NextBlock).get(), B).get();
+	Outer.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(End), BuildAddConstant(BlockEnd, -Offset)).get());
+	Expr *InBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, CreateSimpleDeclRef(Var), CreateSimpleDeclRef(End)).get();
+	Expr *InnerCond = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LAnd, InBlock, BuildParens(Cond).get()).get();
+	Expr *Inc = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_PreInc, CreateSimpleDeclRef(Var)).get();
+	Outer.push_back(SemaRef.ActOnForStmt(SourceLocation(), SourceLocation(), NULL, SemaRef.MakeFullExpr(InnerCond), NULL,
+					     SemaRef.MakeFullExpr(Inc), SourceLocation(), Body).get());
+      }
+      StmtResult OuterBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Outer, false);
+      Statements.push_back(SemaRef.ActOnWhileStmt(SourceLocation(), SemaRef.MakeFullExpr(Cond), NULL, OuterBody.get()).get());
+      BuildCountedLoopEpilogue(Loop, Saved, Statements);
+    }
+    // An array with indefinite layout is entirely owned by thread 0
+    //   init;
+    //   if(MYTHREAD == 0) for(; i < hi; i++) body;
+    void BuildIndefiniteForAll(const CountedLoop& Loop, Stmt *Init, Expr *Cond, Expr *Inc, Stmt *Body, SmallVectorImpl<Stmt*>& Statements) {
+      VarDecl *Saved = BuildCountedLoopPrologue(Loop, 0, false, Init, Statements);
+      std::vector<Expr*> args;
+      Expr *IsZero = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, BuildUPCRCall(Decls->upcr_mythread, args).get(), CreateInteger(SemaRef.Context.IntTy, 0)).get();
+      StmtResult ForLoop = SemaRef.ActOnForStmt(SourceLocation(), SourceLocation(), NULL, SemaRef.MakeFullExpr(Cond), NULL,
+						SemaRef.MakeFullExpr(Inc), SourceLocation(), Body);
+      Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(IsZero), NULL, ForLoop.get(), SourceLocation(), NULL).get());
+      BuildCountedLoopEpilogue(Loop, Saved, Statements);
+    }
+    // Inside upc_forall(...; &a[idx]) the elements b[idx] of any
+    // array with the same blocking as a are local.  Accesses to
+    // them go through a private pointer that is computed once
+    // at the top of the body.
+    struct PrivatizationContext {
+      Expr *Index;
+      uint64_t Rows;
+      std::vector<std::pair<VarDecl*, VarDecl*> > Pointers;
+      SmallVector<Stmt*, 4> Inits;
+    };
+    PrivatizationContext *Privatize;
+    static bool isSameExpr(Expr *LHS, Expr *RHS) {
+      LHS = LHS->IgnoreParenImpCasts();
+      RHS = RHS->IgnoreParenImpCasts();
+      if(LHS->getStmtClass() != RHS->getStmtClass())
+	return false;
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(LHS)) {
+	return DRE->getDecl() == cast<DeclRefExpr>(RHS)->getDecl();
+      } else if(IntegerLiteral *IL = dyn_cast<IntegerLiteral>(LHS)) {
+	return IL->getValue() == cast<IntegerLiteral>(RHS)->getValue();
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(LHS)) {
+	BinaryOperator *Other = cast<BinaryOperator>(RHS);
+	return BO->getOpcode() == Other->getOpcode() &&
+	  isSameExpr(BO->getLHS(), Other->getLHS()) && isSameExpr(BO->getRHS(), Other->getRHS());
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(LHS)) {
+	UnaryOperator *Other = cast<UnaryOperator>(RHS);
+	return UO->getOpcode() == Other->getOpcode() && !UO->isIncrementDecrementOp() &&
+	  isSameExpr(UO->getSubExpr(), Other->getSubExpr());
+      } else if(ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(LHS)) {
+	ArraySubscriptExpr *Other = cast<ArraySubscriptExpr>(RHS);
+	return isSameExpr(ASE->getBase(), Other->getBase()) && isSameExpr(ASE->getIdx(), Other->getIdx());
+      } else if(MemberExpr *ME = dyn_cast<MemberExpr>(LHS)) {
+	MemberExpr *Other = cast<MemberExpr>(RHS);
+	return ME->getMemberDecl() == Other->getMemberDecl() && ME->isArrow() == Other->isArrow() &&
+	  isSameExpr(ME->getBase(), Other->getBase());
+      }
+      return false;
+    }
+    bool isPrivatizable(Expr *E, const PrivatizationContext& Ctx) {
+      E = E->IgnoreParens();
+      // A plain local access would lose the strict ordering
+      if(E->getType().getQualifiers().hasStrict())
+	return false;
+      if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+	FieldDecl *FD = dyn_cast<FieldDecl>(ME->getMemberDecl());
+	return !ME->isArrow() && FD && !FD->isBitField() && isPrivatizable(ME->getBase(), Ctx);
+      }
+      ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(E);
+      if(!Sub || Sub->getType()->isArrayType())
+	return false;
+      VarDecl *Array = getReferencedVar(Sub->getBase());
+      uint64_t Rows;
+      return Array && Array->getType()->isArrayType() && GetRowsPerBlock(Array, Rows) &&
+	Rows == Ctx.Rows && isSameExpr(Sub->getIdx(), Ctx.Index);
+    }
+    bool HasPrivatizableAccess(Stmt *S, const PrivatizationContext& Ctx) {
+      if(!S) return false;
+      if(Expr *E = dyn_cast<Expr>(S))
+	if(E->getType().getQualifiers().hasShared() && isPrivatizable(E, Ctx))
+	  return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasPrivatizableAccess(*Children, Ctx))
+	  return true;
+      }
+      return false;
+    }
+    // Transforming the body a second time must not
+    // emit any declarations twice.
+    static bool HasNonLocalDecls(Stmt *S) {
+      if(!S) return false;
+      if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+	  VarDecl *VD = dyn_cast<VarDecl>(*iter);
+	  if(!VD || !VD->hasLocalStorage())
+	    return true;
+	}
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasNonLocalDecls(*Children))
+	  return true;
+      }
+      return false;
+    }
+    // The type of a privatized access
+    QualType GetPrivateType(QualType Ty) {
+      return TransformType(SemaRef.Context.getCVRQualifiedType(Ty.getUnqualifiedType(), Ty.getCVRQualifiers()));
+    }
+    // Builds the local lvalue for a shared access that satisfies
+    // isPrivatizable
+    Expr *BuildPrivateAccess(Expr *E) {
+      E = E->IgnoreParens();
+      if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+	Expr *Base = BuildPrivateAccess(ME->getBase());
+	FieldDecl *FD = cast<FieldDecl>(TransformDecl(SourceLocation(), ME->getMemberDecl()));
+	DeclarationNameInfo NameInfo(FD->getDeclName(), SourceLocation());
+	return new (SemaRef.Context) MemberExpr(Base, false, FD, NameInfo, GetPrivateType(ME->getType()), VK_LValue, OK_Ordinary);
+      }
+      ArraySubscriptExpr *Sub = cast<ArraySubscriptExpr>(E);
+      VarDecl *Array = getReferencedVar(Sub->getBase());
+      VarDecl *Ptr = 0;
+      for(std::vector<std::pair<VarDecl*, VarDecl*> >::const_iterator iter = Privatize->Pointers.begin(), end = Privatize->Pointers.end(); iter != end; ++iter) {
+	if(iter->first == Array)
+	  Ptr = iter->second;
+      }
+      if(!Ptr) {
+	QualType PtrTy = SemaRef.Context.getPointerType(GetPrivateType(Sub->getType()));
+	// Created inside the body, but initialized before the loop
+	Ptr = CreateFunctionTmpVar(PtrTy);
+	Privatize->Pointers.push_back(std::make_pair(Array, Ptr));
+	std::vector<Expr*> args;
+	args.push_back(TransformArraySubscriptExpr(Sub).get());
+	bool Phaseless = isPhaseless(Sub->getType());
+	Expr *Local = BuildUPCRCall(Phaseless? Decls->UPCR_PSHARED_TO_LOCAL : Decls->UPCR_SHARED_TO_LOCAL, args).get();
+	Local = SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(PtrTy), SourceLocation(), Local).get();
+	Privatize->Inits.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Ptr), Local).get());
+      }
+      // The local access must not overtake a deferred put
+      // to the same array
+      VarDecl *Class = GetAccessClass(Sub);
+      Expr *Local = SyncPutsBefore(CreateSimpleDeclRef(Ptr), Class);
+      return BuildParens(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, Local).get()).get();
+    }
+    bool isPrivatized(Expr *E) {
+      return Privatize && isPrivatizable(E, *Privatize);
+    }
+    // Finds the index whose elements have the affinity of
+    // each iteration of a upc_forall.
+    bool GetPrivatizationContext(UPCForAllStmt *S, PrivatizationContext& Ctx) {
+      VarDecl *Array;
+      if(!S->getAfnty()) {
+	return false;
+      } else if(!isPointerToShared(S->getAfnty()->getType())) {
+	Ctx.Index = S->getAfnty();
+	Ctx.Rows = 1;
+      } else if(!GetArrayAndIndex(S->getAfnty(), Array, Ctx.Index) ||
+		!GetRowsPerBlock(Array, Ctx.Rows) || Ctx.Rows == 0) {
+	return false;
+      }
+      // The index has to mean the same thing everywhere in the body
+      UPCUsageFinder Finder;
+      LoopBodyInfo Info;
+      ScanLoopBody(S->getBody(), Info, false);
+      return !Ctx.Index->HasSideEffects(SemaRef.Context) && !Finder.mark(Ctx.Index) &&
+	isLoopInvariant(Ctx.Index, Info);
+    }
+    // Transforms the body of a upc_forall for the iterations
+    // that have our affinity, or returns an error if there's
+    // nothing to privatize.
+    StmtResult TransformPrivatizedBody(UPCForAllStmt *S) {
+      PrivatizationContext Ctx;
+      if(!GetPrivatizationContext(S, Ctx) ||
+	 !HasPrivatizableAccess(S->getBody(), Ctx) || HasNonLocalDecls(S->getBody()))
+	return StmtError();
+
+      PrivatizationContext *Saved = Privatize;
+      Privatize = &Ctx;
+      StmtResult Result;
+      {
+	Sema::CompoundScopeRAII BodyScope(SemaRef);
+	Stmt *Body = TransformStmt(S->getBody()).get();
+	Ctx.Inits.push_back(Body);
+	Result = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Ctx.Inits, false);
+      }
+      Privatize = Saved;
+      return Result;
+    }
+    // A barrier lowered to upcr_notify before statement Notify
+    // and upcr_wait after statement Wait of its block.
+    struct SplitBarrier {
+      std::size_t Notify;
+      std::size_t Barrier;
+      std::size_t Wait;
+    };
+    // Statements that only touch this thread's private data
+    // and always fall through can run between the notify and
+    // wait of a barrier.
+    bool isPrivateWork(Stmt *S) {
+      return isLocalWork(S, 0);
+    }
+    // Like isPrivateWork, but shared accesses with the affinity
+    // of the current iteration of Ctx are allowed too.
+    bool isLocalWork(Stmt *S, const PrivatizationContext *Ctx) {
+      if(!S) return true;
+      if(isa<CallExpr>(S) || isa<ReturnStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) ||
+	 isa<LabelStmt>(S) || isa<BreakStmt>(S) || isa<ContinueStmt>(S) || isa<SwitchStmt>(S) ||
+	 isa<AsmStmt>(S) || isa<StmtExpr>(S) || isa<UPCNotifyStmt>(S) || isa<UPCWaitStmt>(S) ||
+	 isa<UPCBarrierStmt>(S) || isa<UPCFenceStmt>(S) || isa<UPCForAllStmt>(S))
+	return false;
+      if(Expr *E = dyn_cast<Expr>(S)) {
+	if(Ctx && E->getType().getQualifiers().hasShared() && isPrivatizable(E, *Ctx))
+	  return true;
+	if(TypeHasUPC(E->getType()) || E->getType().isVolatileQualified())
+	  return false;
+	// A private pointer can point into shared memory
+	if(UnaryOperator *UO = dyn_cast<UnaryOperator>(E))
+	  if(UO->getOpcode() == UO_Deref)
+	    return false;
+	if(MemberExpr *ME = dyn_cast<MemberExpr>(E))
+	  if(ME->isArrow())
+	    return false;
+	if(ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(E))
+	  if(!Sub->getBase()->IgnoreParenImpCasts()->getType()->isArrayType())
+	    return false;
+      } else if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+	  VarDecl *VD = dyn_cast<VarDecl>(*iter);
+	  if(!VD || TypeHasUPC(VD->getType()) || VD->getType()->isVariablyModifiedType())
+	    return false;
+	}
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(!isLocalWork(*Children, Ctx))
+	  return false;
+      }
+      return true;
+    }
+    // A upc_forall in which every thread only touches
+    // private data and shared data with its own affinity.
+    // Barriers can't be executed inside a upc_forall, so
+    // the affinity test is known to be used here.
+    bool isAffinityLocalForAll(Stmt *S) {
+      UPCForAllStmt *ForAll = dyn_cast<UPCForAllStmt>(S);
+      PrivatizationContext Ctx;
+      return ForAll && !ForAll->getConditionVariable() && GetPrivatizationContext(ForAll, Ctx) &&
+	isPrivateWork(ForAll->getInit()) && isPrivateWork(ForAll->getCond()) &&
+	isPrivateWork(ForAll->getInc()) && isLocalWork(ForAll->getBody(), &Ctx);
+    }
+    unsigned GetLine(SourceLocation Loc) {
+      PresumedLoc PLoc = SemaRef.getSourceManager().getPresumedLoc(Loc);
+      return PLoc.isValid()? PLoc.getLine() : 0;
+    }
+    static bool isBarrierWithoutId(Stmt *S) {
+      UPCBarrierStmt *Barrier = dyn_cast<UPCBarrierStmt>(S);
+      return Barrier && !Barrier->getIdValue();
+    }
+    // Whether S contains a statement that can leave the
+    // function early or be jumped to.
+    static bool mayJump(Stmt *S) {
+      if(!S) return false;
+      if(isa<ReturnStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) ||
+	 isa<LabelStmt>(S) || isa<AsmStmt>(S))
+	return true;
+      if(CallExpr *Call = dyn_cast<CallExpr>(S))
+	if(FunctionDecl *FD = Call->getDirectCallee())
+	  if(FD->isNoReturn())
+	    return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(mayJump(*Children))
+	  return true;
+      }
+      return false;
+    }
+    // Removing a barrier is only safe if every thread
+    // executes it.  That is only known for the statements
+    // at the top level of main, up to the first one that
+    // might let some threads skip the rest.  Code
+    // anywhere else may be reached only by some threads,
+    // e.g. under if(MYTHREAD == 0), and the others would
+    // be left waiting for the missing barrier.
+    std::size_t CollectiveLimit(CompoundStmt *S) {
+      if(!CurrentFunctionIsMain || S != CurrentFunctionBody)
+	return 0;
+      std::size_t i = 0;
+      while(i < S->size() && !mayJump(S->body_begin()[i]))
+	++i;
+      return i;
+    }
+    // Finds the barriers and fences of a block that can be
+    // dropped:
+    //   - a fence with only private work since the last
+    //     barrier or fence, or a fence followed by a barrier
+    //   - in code that all threads execute, a barrier with
+    //     only private work since the last barrier, or a
+    //     barrier between two upc_foralls that only touch
+    //     data with the affinity of the iteration, when the
+    //     whole run is enclosed by barriers
+    void PlanRedundantSyncs(CompoundStmt *S, std::set<std::size_t>& Removed) {
+      Stmt **Body = S->body_begin();
+      std::size_t Size = S->size();
+      std::size_t Collective = CollectiveLimit(S);
+      const std::size_t None = std::size_t(-1);
+      // The last barrier or fence with only private work after it
+      std::size_t LastSync = None;
+      for(std::size_t i = 0; i < Size; ++i) {
+	if(isa<UPCBarrierStmt>(Body[i]) || isa<UPCFenceStmt>(Body[i])) {
+	  if(isa<UPCFenceStmt>(Body[i]) && LastSync != None) {
+	    Removed.insert(i);
+	    Remark(Body[i]->getLocStart(), "removed upc_fence: no shared accesses since line " + Twine(GetLine(Body[LastSync]->getLocStart())));
+	    continue;
+	  }
+	  if(LastSync != None && isa<UPCFenceStmt>(Body[LastSync])) {
+	    Removed.insert(LastSync);
+	    Remark(Body[LastSync]->getLocStart(), "removed upc_fence: followed by the barrier at line " + Twine(GetLine(Body[i]->getLocStart())));
+	    LastSync = None;
+	  }
+	  if(LastSync != None && i < Collective && isBarrierWithoutId(Body[i])) {
+	    Removed.insert(i);
+	    Remark(Body[i]->getLocStart(), "removed upc_barrier: no shared accesses since the barrier at line " + Twine(GetLine(Body[LastSync]->getLocStart())));
+	    continue;
+	  }
+	  LastSync = i;
+	} else if(!isPrivateWork(Body[i])) {
+	  LastSync = None;
+	}
+      }
+      // The barriers of the current run.  Only the first and
+      // last are needed.
+      std::vector<std::size_t> Run;
+      for(std::size_t i = 0; i <= Collective; ++i) {
+	if(i < Collective && (Removed.count(i) || isPrivateWork(Body[i])))
+	  continue;
+	if(i < Collective && isa<UPCBarrierStmt>(Body[i])) {
+	  Run.push_back(i);
+	  if(isBarrierWithoutId(Body[i]))
+	    continue;
+	} else if(i < Collective && !Run.empty() && isAffinityLocalForAll(Body[i])) {
+	  continue;
+	}
+	for(std::size_t j = 1; j + 1 < Run.size(); ++j) {
+	  if(isBarrierWithoutId(Body[Run[j]])) {
+	    Removed.insert(Run[j]);
+	    Remark(Body[Run[j]]->getLocStart(), "removed upc_barrier: the upc_foralls around it only access data with their own affinity");
+	  }
+	}
+	Run.clear();
+	if(i < Collective && isa<UPCBarrierStmt>(Body[i]))
+	  Run.push_back(i);
+      }
+    }
+    // Finds the barriers of a block that have private work
+    // before or after them.  A barrier with a non-constant id
+    // would need its id saved, so it is left alone.
+    void PlanSplitBarriers(CompoundStmt *S, const std::set<std::size_t>& Removed, std::vector<SplitBarrier>& Result) {
+      std::size_t Size = S->size();
+      std::size_t Floor = 0;
+      for(std::size_t i = 0; i < Size; ++i) {
+	UPCBarrierStmt *Barrier = dyn_cast<UPCBarrierStmt>(S->body_begin()[i]);
+	if(!Barrier || Removed.count(i) ||
+	   (Barrier->getIdValue() && !Barrier->getIdValue()->isIntegerConstantExpr(SemaRef.Context)))
+	  continue;
+	SplitBarrier Split = { i, i, i };
+	while(Split.Notify > Floor && (Removed.count(Split.Notify - 1) || isPrivateWork(S->body_begin()[Split.Notify - 1])))
+	  --Split.Notify;
+	while(Split.Wait + 1 < Size && (Removed.count(Split.Wait + 1) || isPrivateWork(S->body_begin()[Split.Wait + 1])))
+	  ++Split.Wait;
+	if(Split.Notify == Split.Wait)
+	  continue;
+	Result.push_back(Split);
+	Remark(Barrier->getLocStart(), "split barrier into notify and wait around " +
+	       Twine(unsigned(Split.Wait - Split.Notify)) + " private statement(s)");
+	Floor = Split.Wait + 1;
+	i = Split.Wait;
+      }
+    }
+    Stmt *BuildBarrierHalf(UPCBarrierStmt *S, FunctionDecl *Half) {
+      Expr *ID = S->getIdValue();
+      std::vector<Expr*> args;
+      if(ID) {
+	args.push_back(TransformExpr(ID).get());
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
+      } else {
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, 1));
+      }
+      return SyncPutsBefore(BuildSyncCall(Half, args));
+    }
+    // Reads of fields of the same shared struct in one statement
+    // are served from a private copy that is fetched with a single
+    // get before the statement.
+    struct CoalescedStruct {
+      Expr *Base;
+      bool IsArrow;
+      QualType Type;
+      uint64_t Begin;
+      uint64_t End;
+      unsigned Reads;
+      VarDecl *Tmp;
+    };
+    std::vector<CoalescedStruct> *Coalesced;
+    static bool HasSharedRead(Stmt *S) {
+      if(!S) return false;
+      if(ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S))
+	if(ICE->getCastKind() == CK_LValueToRValue && ICE->getSubExpr()->getType().getQualifiers().hasShared())
+	  return true;
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasSharedRead(*Children))
+	  return true;
+      }
+      return false;
+    }
+    // Anything that could change shared memory or
+    // requires ordering between shared accesses
+    static bool HasCoalesceBlocker(Stmt *S) {
+      if(!S) return false;
+      if(isa<CallExpr>(S) || isa<StmtExpr>(S)) {
+	return true;
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isAssignmentOp() && BO->getLHS()->getType().getQualifiers().hasShared())
+	  return true;
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->isIncrementDecrementOp() && UO->getSubExpr()->getType().getQualifiers().hasShared())
+	  return true;
+      } else if(ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+	if(ICE->getCastKind() == CK_LValueToRValue && ICE->getSubExpr()->getType().getQualifiers().hasStrict())
+	  return true;
+      } else if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+	  VarDecl *VD = dyn_cast<VarDecl>(*iter);
+	  if(!VD || !VD->hasLocalStorage())
+	    return true;
+	}
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasCoalesceBlocker(*Children))
+	  return true;
+      }
+      return false;
+    }
+    // Whether the shared reads in statement S can be
+    // issued before the statement
+    static bool CanReadEarly(Stmt *S) {
+      if(!isa<Expr>(S) && !isa<DeclStmt>(S))
+	return false;
+      // The reads of an assignment all happen before its
+      // store, so only its operands need to be checked.
+      Expr *E = dyn_cast<Expr>(S);
+      BinaryOperator *Assign = E? dyn_cast<BinaryOperator>(E->IgnoreParens()) : 0;
+      if(Assign && Assign->isAssignmentOp())
+	return !HasCoalesceBlocker(Assign->getLHS()) && !HasCoalesceBlocker(Assign->getRHS());
+      return !HasCoalesceBlocker(S);
+    }
+    // The base of a coalesced read must have the same
+    // value everywhere in the statement.
+    bool isStableBase(Expr *Base, const LoopBodyInfo& Info) {
+      if(Base->HasSideEffects(SemaRef.Context) || HasSharedRead(Base))
+	return false;
+      std::set<VarDecl*> Vars;
+      CollectReferencedVars(Base, Vars);
+      for(std::set<VarDecl*>::const_iterator iter = Vars.begin(), end = Vars.end(); iter != end; ++iter) {
+	if(Info.Modified.count(*iter))
+	  return false;
+	// The address of a shared variable never changes
+	if(!((*iter)->getType()->isArrayType() || (*iter)->getType().getQualifiers().hasShared() ||
+	     isPrivateLocal(*iter) || (*iter)->getType().isConstQualified()))
+	  return false;
+      }
+      return true;
+    }
+    void CollectCoalescedReads(Stmt *S, const LoopBodyInfo& Info, std::vector<CoalescedStruct>& Result) {
+      if(!S) return;
+      ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S);
+      MemberExpr *ME = ICE && ICE->getCastKind() == CK_LValueToRValue?
+	dyn_cast<MemberExpr>(ICE->getSubExpr()->IgnoreParens()) : 0;
+      FieldDecl *FD = ME? dyn_cast<FieldDecl>(ME->getMemberDecl()) : 0;
+      if(FD && !FD->isBitField() && ME->getType().getQualifiers().hasShared() &&
+	 !isPrivatized(ME) && isStableBase(ME->getBase(), Info)) {
+	QualType Ty = ME->getBase()->getType();
+	if(ME->isArrow())
+	  Ty = Ty->getAs<PointerType>()->getPointeeType();
+	uint64_t Offset = SemaRef.Context.toCharUnitsFromBits(SemaRef.Context.getFieldOffset(FD)).getQuantity();
+	uint64_t Size = SemaRef.Context.getTypeSizeInChars(FD->getType()).getQuantity();
+	std::vector<CoalescedStruct>::iterator iter = Result.begin(), end = Result.end();
+	for(; iter != end; ++iter) {
+	  if(iter->IsArrow == ME->isArrow() && isSameExpr(iter->Base, ME->getBase()))
+	    break;
+	}
+	if(iter == end) {
+	  CoalescedStruct Entry = { ME->getBase(), ME->isArrow(), Ty, Offset, Offset + Size, 0, 0 };
+	  Result.push_back(Entry);
+	  iter = Result.end() - 1;
+	}
+	iter->Begin = std::min(iter->Begin, Offset);
+	iter->End = std::max(iter->End, Offset + Size);
+	++iter->Reads;
+	return;
+      }
+      // Only operands that are always evaluated, since the
+      // struct is fetched unconditionally before the statement
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isLogicalOp()) {
+	  CollectCoalescedReads(BO->getLHS(), Info, Result);
+	  return;
+	}
+      } else if(AbstractConditionalOperator *CO = dyn_cast<AbstractConditionalOperator>(S)) {
+	CollectCoalescedReads(CO->getCond(), Info, Result);
+	return;
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	CollectCoalescedReads(*Children, Info, Result);
+      }
+    }
+    // Finds the structs in S that are read more than once,
+    // and emits the gets for them into Fetches.
+    bool FindCoalescedReads(Stmt *S, std::vector<CoalescedStruct>& Result, SmallVectorImpl<Stmt*>& Fetches) {
+      if(!CanReadEarly(S))
+	return false;
+      LoopBodyInfo Info;
+      ScanLoopBody(S, Info, true);
+      std::vector<CoalescedStruct> Reads;
+      CollectCoalescedReads(S, Info, Reads);
+      for(std::vector<CoalescedStruct>::iterator iter = Reads.begin(), end = Reads.end(); iter != end; ++iter) {
+	if(iter->Reads < 2)
+	  continue;
+	iter->Tmp = CreateTmpVar(GetPrivateType(iter->Type));
+	Expr *Ptr = TransformExpr(iter->Base).get();
+	if(!isPhaseless(iter->Type)) {
+	  std::vector<Expr*> args;
+	  args.push_back(Ptr);
+	  Ptr = BuildUPCRCall(Decls->UPCR_SHARED_TO_PSHARED, args).get();
+	}
+	Expr *Dst = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(iter->Tmp)).get();
+	if(iter->Begin != 0) {
+	  TypeSourceInfo *CharPtr = SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.getPointerType(SemaRef.Context.CharTy));
+	  Dst = SemaRef.BuildCStyleCastExpr(SourceLocation(), CharPtr, SourceLocation(), Dst).get();
+	  Dst = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Dst, CreateInteger(SemaRef.Context.getSizeType(), (int)iter->Begin)).get();
+	}
+	std::vector<Expr*> args;
+	args.push_back(Dst);
+	args.push_back(Ptr);
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, (int)iter->Begin));
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, (int)(iter->End - iter->Begin)));
+	NoteAccess(false, false, iter->End - iter->Begin);
+	Fetches.push_back(BuildUPCRCall(Decls->UPCR_GET_PSHARED, args).get());
+	Result.push_back(*iter);
+      }
+      return !Result.empty();
+    }
+    CoalescedStruct *FindCoalesced(Expr *E) {
+      if(!Coalesced)
+	return 0;
+      MemberExpr *ME = dyn_cast<MemberExpr>(E->IgnoreParens());
+      FieldDecl *FD = ME? dyn_cast<FieldDecl>(ME->getMemberDecl()) : 0;
+      if(!FD || FD->isBitField())
+	return 0;
+      // Reads that are not always evaluated may be
+      // outside of the range that was fetched
+      uint64_t Offset = SemaRef.Context.toCharUnitsFromBits(SemaRef.Context.getFieldOffset(FD)).getQuantity();
+      uint64_t Size = SemaRef.Context.getTypeSizeInChars(FD->getType()).getQuantity();
+      for(std::vector<CoalescedStruct>::iterator iter = Coalesced->begin(), end = Coalesced->end(); iter != end; ++iter) {
+	if(iter->IsArrow == ME->isArrow() && isSameExpr(iter->Base, ME->getBase()) &&
+	   iter->Begin <= Offset && Offset + Size <= iter->End)
+	  return &*iter;
+      }
+      return 0;
+    }
+    Expr *BuildCoalescedRead(CoalescedStruct *Entry, Expr *E) {
+      MemberExpr *ME = cast<MemberExpr>(E->IgnoreParens());
+      FieldDecl *FD = cast<FieldDecl>(TransformDecl(SourceLocation(), ME->getMemberDecl()));
+      DeclarationNameInfo NameInfo(FD->getDeclName(), SourceLocation());
+      return new (SemaRef.Context) MemberExpr(CreateSimpleDeclRef(Entry->Tmp), false, FD, NameInfo, GetPrivateType(ME->getType()), VK_LValue, OK_Ordinary);
+    }
+    // A counted loop that only reads a[i] (or only writes
+    // every a[i]) for a range of a that is contiguous on one
+    // thread.  The range is moved with one bulk get before
+    // the loop or one bulk put after it.
+    struct BulkAccess {
+      Expr *Base;
+      VarDecl *Var;
+      bool IsWrite;
+      VarDecl *Buffer;
+      VarDecl *Start;
+    };
+    BulkAccess *Bulk;
+    struct BulkScan {
+      BulkScan() : Base(0), Reads(0), Writes(0), OtherReads(0), Blocked(false) {}
+      Expr *Base;
+      unsigned Reads;
+      unsigned Writes;
+      unsigned OtherReads;
+      bool Blocked;
+    };
+    // Whether E is a[i] for the loop variable i
+    static bool isLoopElement(Expr *E, VarDecl *Var) {
+      ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(E->IgnoreParens());
+      return Sub && !Sub->getType()->isArrayType() && getReferencedVar(Sub->getIdx()) == Var &&
+	getReferencedVar(Sub->getBase()) && isPointerToShared(Sub->getBase()->getType());
+    }
+    bool isBulkCandidate(Expr *E, VarDecl *Var, BulkScan& Scan) {
+      if(!isLoopElement(E, Var) || E->getType().getQualifiers().hasStrict())
+	return false;
+      Expr *Base = cast<ArraySubscriptExpr>(E->IgnoreParens())->getBase();
+      if(!Scan.Base)
+	Scan.Base = Base;
+      return isSameExpr(Scan.Base, Base);
+    }
+    void ScanBulkLoop(Stmt *S, VarDecl *Var, BulkScan& Scan) {
+      if(!S) return;
+      if(isa<CallExpr>(S) || isa<StmtExpr>(S) || isa<ReturnStmt>(S) || isa<ContinueStmt>(S) ||
+	 isa<BreakStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) || isa<LabelStmt>(S) ||
+	 isa<AsmStmt>(S)) {
+	// Every iteration has to run to the end of the body
+	Scan.Blocked = true;
+      } else if(ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+	if(ICE->getCastKind() == CK_LValueToRValue && ICE->getSubExpr()->getType().getQualifiers().hasShared()) {
+	  if(isBulkCandidate(ICE->getSubExpr(), Var, Scan)) {
+	    ++Scan.Reads;
+	    return;
+	  }
+	  ++Scan.OtherReads;
+	}
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isAssignmentOp() && BO->getLHS()->getType().getQualifiers().hasShared()) {
+	  if(BO->getOpcode() == BO_Assign && isBulkCandidate(BO->getLHS(), Var, Scan)) {
+	    ++Scan.Writes;
+	    ScanBulkLoop(BO->getRHS(), Var, Scan);
+	    return;
+	  }
+	  Scan.Blocked = true;
+	}
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->isIncrementDecrementOp() && UO->getSubExpr()->getType().getQualifiers().hasShared())
+	  Scan.Blocked = true;
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	ScanBulkLoop(*Children, Var, Scan);
+      }
+    }
+    // A bulk put overwrites the whole range, so every
+    // iteration has to store its element.
+    static bool isUnconditionalStore(Stmt *Body, VarDecl *Var) {
+      Stmt *Stores[] = { Body };
+      ArrayRef<Stmt*> Children(Stores);
+      if(CompoundStmt *CS = dyn_cast<CompoundStmt>(Body))
+	Children = ArrayRef<Stmt*>(CS->body_begin(), CS->size());
+      for(ArrayRef<Stmt*>::iterator iter = Children.begin(), end = Children.end(); iter != end; ++iter) {
+	if(Expr *E = dyn_cast<Expr>(*iter))
+	  if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E->IgnoreParens()))
+	    if(BO->getOpcode() == BO_Assign && isLoopElement(BO->getLHS(), Var))
+	      return true;
+      }
+      return false;
+    }
+    // The number of elements of a[] that the range
+    // can cover and stay on one thread, or 0 for any number.
+    bool GetBulkBlockSize(Expr *Base, uint64_t& Rows) {
+      VarDecl *VD = getReferencedVar(Base);
+      if(VD->getType()->isArrayType())
+	return GetRowsPerBlock(VD, Rows) && Rows != 1;
+      // The phase of a pointer is unknown, so only
+      // indefinite layouts are contiguous.
+      Rows = 0;
+      return VD->getType()->getAs<PointerType>()->getPointeeType().getQualifiers().getLayoutQualifier() == 0;
+    }
+    // Lowers for(init; i < hi; i++) body to
+    //   init; start = i; count = hi - i;
+    //   if(count > 0 && count <= K && (start / B == (start + count - 1) / B)) {
+    //     get buf[0..count) from &a[start];
+    //     for(; i < hi; i++) body with a[i] replaced by buf[i - start];
+    //     (or put buf[0..count) to &a[start] for stores)
+    //   } else {
+    //     for(; i < hi; i++) body;
+    //   }
+    StmtResult TransformBulkForStmt(ForStmt *S) {
+      CountedLoop Loop;
+      if(!GetCountedLoop(S->getInit(), S->getCond(), S->getInc(), S->getBody(), Loop) ||
+	 HasNonLocalDecls(S->getBody()))
+	return StmtError();
+      BulkScan Scan;
+      ScanBulkLoop(S->getBody(), Loop.Var, Scan);
+      if(Scan.Blocked || !Scan.Base)
+	return StmtError();
+      bool IsWrite = Scan.Writes != 0;
+      if(IsWrite? (Scan.Reads != 0 || Scan.OtherReads != 0 || !isUnconditionalStore(S->getBody(), Loop.Var)) : Scan.Reads == 0)
+	return StmtError();
+      // A store through a local pointer may change the
+      // elements after they were copied into the buffer.
+      if(!IsWrite && HasIndirectStore(S->getBody()))
+	return StmtError();
+      VarDecl *Array = getReferencedVar(Scan.Base);
+      LoopBodyInfo Info;
+      ScanLoopBody(S->getBody(), Info, false);
+      if(!Array->getType()->isArrayType() && (!isPrivateLocal(Array) || Info.Modified.count(Array)))
+	return StmtError();
+      // The range is computed before the loop starts
+      if(!isLoopInvariant(Loop.Upper, Info))
+	return StmtError();
+      uint64_t Rows;
+      if(!GetBulkBlockSize(Scan.Base, Rows))
+	return StmtError();
+      QualType ElemTy = Scan.Base->getType()->getAs<PointerType>()->getPointeeType();
+      uint64_t ElementSize = SemaRef.Context.getTypeSizeInChars(ElemTy).getQuantity();
+      uint64_t Capacity = ElementSize? Options.BulkLoopLimit / ElementSize : 0;
+      if(Capacity < 2)
+	return StmtError();
+      if(Rows != 0 && Capacity > Rows)
+	Capacity = Rows;
+
+      SmallVector<Stmt*, 8> Statements;
+      StmtResult Init = TransformStmt(S->getInit());
+      ExprResult Cond = TransformExpr(S->getCond());
+      Cond = SemaRef.ActOnBooleanCondition(0, S->getForLoc(), Cond.get());
+      Sema::FullExprArg FullCond(SemaRef.MakeFullExpr(Cond.get()));
+      ExprResult Inc = TransformExpr(S->getInc());
+      Sema::FullExprArg FullInc(SemaRef.MakeFullExpr(Inc.get()));
+      Statements.push_back(Init.get());
+
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      QualType VarTy = Var->getType().getUnqualifiedType();
+      VarDecl *Start = CreateTmpVar(VarTy);
+      VarDecl *Count = CreateTmpVar(SemaRef.Context.LongTy);
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Start), CreateSimpleDeclRef(Var)).get());
+      Expr *Upper = TransformExpr(Loop.Upper).get();
+      Expr *Length = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, BuildParens(Upper).get(), CreateSimpleDeclRef(Var)).get();
+      if(Loop.Inclusive)
+	Length = BuildAddConstant(Length, 1);
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Count), Length).get());
+
+      Expr *Fits = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LAnd,
+	SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_GT, CreateSimpleDeclRef(Count), CreateInteger(SemaRef.Context.IntTy, 0)).get(),
+	SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LE, CreateSimpleDeclRef(Count), CreateInteger(SemaRef.Context.IntTy, (int)Capacity)).get()).get();
+      if(Rows != 0) {
+	Expr *B = CreateInteger(SemaRef.Context.IntTy, (int)Rows);
+	Expr *First = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Div, CreateSimpleDeclRef(Start), B).get();
+	Expr *LastIndex = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, CreateSimpleDeclRef(Start), CreateSimpleDeclRef(Count)).get();
+	LastIndex = BuildAddConstant(LastIndex, -1);
+	Expr *Last = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Div, LastIndex, B).get();
+	Expr *SameBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, First, Last).get();
+	Fits = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LAnd, Fits, BuildParens(SameBlock).get()).get();
+      }
+
+      // The bulk version
+      QualType BufferTy = SemaRef.Context.getConstantArrayType(GetPrivateType(ElemTy), llvm::APInt(32, Capacity), ArrayType::Normal, 0);
+      BulkAccess Access = { Scan.Base, Loop.Var, IsWrite, CreateTmpVar(BufferTy), Start };
+      Expr *Remote = CreateUPCPointerArithmetic(TransformExpr(Scan.Base).get(), CreateSimpleDeclRef(Start), Scan.Base->getType()).get();
+      Expr *Bytes = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, CreateSimpleDeclRef(Count), CreateInteger(SemaRef.Context.IntTy, (int)ElementSize)).get();
+      bool Phaseless = isPhaseless(ElemTy);
+      // The deferred puts that the bulk access may overlap
+      VarDecl *Class = Scan.Base->IgnoreParenImpCasts()->getType()->isArrayType()? GetAccessClass(Scan.Base) : 0;
+      // Counted at the size of the buffer
+      NoteAccess(IsWrite, false, Capacity * ElementSize);
+      std::vector<Expr*> args;
+      StmtResult BulkLoop;
+      {
+	Sema::CompoundScopeRAII BodyScope(SemaRef);
+	SmallVector<Stmt*, 4> BulkStatements;
+	if(IsWrite) {
+	  args.push_back(Remote);
+	  args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
+	  args.push_back(CreateSimpleDeclRef(Access.Buffer));
+	  args.push_back(Bytes);
+	} else {
+	  args.push_back(CreateSimpleDeclRef(Access.Buffer));
+	  args.push_back(Remote);
+	  args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
+	  args.push_back(Bytes);
+	  BulkStatements.push_back(SyncPutsBefore(BuildUPCRCall(Phaseless? Decls->UPCR_GET_PSHARED : Decls->UPCR_GET_SHARED, args).get(), Class));
+	}
+	BulkAccess *SavedBulk = Bulk;
+	Bulk = &Access;
+	StmtResult Body = TransformStmt(S->getBody());
+	Bulk = SavedBulk;
+	BulkStatements.push_back(SemaRef.ActOnForStmt(S->getForLoc(), S->getLParenLoc(), NULL, FullCond, NULL,
+						      FullInc, S->getRParenLoc(), Body.get()).get());
+	if(IsWrite)
+	  BulkStatements.push_back(SyncPutsBefore(BuildUPCRCall(Phaseless? Decls->UPCR_PUT_PSHARED : Decls->UPCR_PUT_SHARED, args).get(), Class));
+	BulkLoop = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), BulkStatements, false);
+      }
+      // The general version
+      StmtResult Body = TransformStmt(S->getBody());
+      StmtResult PlainLoop = SemaRef.ActOnForStmt(S->getForLoc(), S->getLParenLoc(), NULL, FullCond, NULL,
+						  FullInc, S->getRParenLoc(), Body.get());
+      Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(Fits), NULL, BulkLoop.get(), SourceLocation(), PlainLoop.get()).get());
+
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+    }
+    bool isBulkAccess(Expr *E) {
+      if(!Bulk || !isLoopElement(E, Bulk->Var))
+	return false;
+      return isSameExpr(cast<ArraySubscriptExpr>(E->IgnoreParens())->getBase(), Bulk->Base);
+    }
+    // buf[i - start]
+    Expr *BuildBulkAccess() {
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Bulk->Var));
+      Expr *Index = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, CreateSimpleDeclRef(Var), CreateSimpleDeclRef(Bulk->Start)).get();
+      return SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Bulk->Buffer), SourceLocation(), Index, SourceLocation()).get();
+    }
+    // In a counted loop, a[i + c] for a base that doesn't
+    // change is replaced by a pointer that starts at
+    // &a[lo + c] and is incremented along with i.
+    struct InductionPointer {
+      Expr *Base;
+      VarDecl *Var;
+      int64_t Offset;
+      VarDecl *Ptr;
+    };
+    std::vector<InductionPointer> *Induction;
+    bool isInductionBase(Expr *Base, const LoopBodyInfo& Info) {
+      VarDecl *VD = getReferencedVar(Base);
+      if(!VD || !isPointerToShared(Base->getType()))
+	return false;
+      return VD->getType()->isArrayType() || (isPrivateLocal(VD) && !Info.Modified.count(VD));
+    }
+    void CollectInductionPointers(Stmt *S, VarDecl *Var, const LoopBodyInfo& Info, std::vector<InductionPointer>& Result) {
+      if(!S) return;
+      if(ArraySubscriptExpr *Sub = dyn_cast<ArraySubscriptExpr>(S)) {
+	int64_t Offset;
+	if(!Sub->getType()->isArrayType() && !isPrivatized(Sub) &&
+	   isInductionBase(Sub->getBase(), Info) &&
+	   GetAffineAffinity(Sub->getIdx(), Var, Offset) &&
+	   !FindInductionPointer(Sub->getBase(), Offset, Result)) {
+	  InductionPointer Ptr = { Sub->getBase(), Var, Offset, 0 };
+	  Result.push_back(Ptr);
+	}
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	CollectInductionPointers(*Children, Var, Info, Result);
+      }
+    }
+    InductionPointer *FindInductionPointer(Expr *Base, int64_t Offset, std::vector<InductionPointer>& Pointers) {
+      for(std::vector<InductionPointer>::iterator iter = Pointers.begin(), end = Pointers.end(); iter != end; ++iter) {
+	if(iter->Offset == Offset && isSameExpr(iter->Base, Base))
+	  return &*iter;
+      }
+      return 0;
+    }
+    VarDecl *FindInductionPointer(ArraySubscriptExpr *E) {
+      int64_t Offset;
+      if(!Induction || Induction->empty() || E->getType()->isArrayType() ||
+	 !GetAffineAffinity(E->getIdx(), Induction->front().Var, Offset))
+	return 0;
+      InductionPointer *Ptr = FindInductionPointer(E->getBase(), Offset, *Induction);
+      return Ptr? Ptr->Ptr : 0;
+    }
+    // upcr_inc_shared(&p, elemsz, 1, B) or the phaseless forms
+    Expr *BuildInductionIncrement(const InductionPointer& Ptr) {
+      QualType PointeeType = Ptr.Base->getType()->getAs<PointerType>()->getPointeeType();
+      int LayoutQualifier = PointeeType.getQualifiers().getLayoutQualifier();
+      std::vector<Expr*> args;
+      args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(Ptr.Ptr)).get());
+      args.push_back(CreateInteger(SemaRef.Context.IntTy, SemaRef.Context.getTypeSizeInChars(PointeeType).getQuantity()));
+      args.push_back(CreateInteger(SemaRef.Context.IntTy, 1));
+      if(LayoutQualifier == 0) {
+	return BuildUPCRCall(Decls->UPCR_INC_PSHAREDI, args).get();
+      } else if(isPhaseless(PointeeType)) {
+	return BuildUPCRCall(Decls->UPCR_INC_PSHARED1, args).get();
+      } else {
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, LayoutQualifier));
+	return BuildUPCRCall(Decls->UPCR_INC_SHARED, args).get();
+      }
+    }
+    // Lowers for(init; i < hi; i++) body to
+    //   init; p = &a[i + c];
+    //   for(; i < hi; i++, upcr_inc_shared(&p, ...)) body with a[i + c] replaced by *p;
+    StmtResult TransformInductionForStmt(ForStmt *S) {
+      CountedLoop Loop;
+      if(!GetCountedLoop(S->getInit(), S->getCond(), S->getInc(), S->getBody(), Loop))
+	return StmtError();
+      LoopBodyInfo Info;
+      ScanLoopBody(S->getBody(), Info, false);
+      std::vector<InductionPointer> Pointers;
+      CollectInductionPointers(S->getBody(), Loop.Var, Info, Pointers);
+      if(Pointers.empty())
+	return StmtError();
+
+      SmallVector<Stmt*, 8> Statements;
+      Statements.push_back(TransformStmt(S->getInit()).get());
+      VarDecl *Var = cast<VarDecl>(TransformDecl(SourceLocation(), Loop.Var));
+      ExprResult Inc = TransformExpr(S->getInc());
+      for(std::vector<InductionPointer>::iterator iter = Pointers.begin(), end = Pointers.end(); iter != end; ++iter) {
+	QualType PointeeType = iter->Base->getType()->getAs<PointerType>()->getPointeeType();
+	iter->Ptr = CreateTmpVar(isPhaseless(PointeeType)? Decls->upcr_pshared_ptr_t : Decls->upcr_shared_ptr_t);
+	Expr *Start = CreateUPCPointerArithmetic(TransformExpr(iter->Base).get(), BuildAddConstant(CreateSimpleDeclRef(Var), iter->Offset), iter->Base->getType()).get();
+	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(iter->Ptr), Start).get());
+	Inc = BuildComma(Inc.get(), BuildInductionIncrement(*iter));
+      }
+      ExprResult Cond = TransformExpr(S->getCond());
+      Cond = SemaRef.ActOnBooleanCondition(0, S->getForLoc(), Cond.get());
+      std::vector<InductionPointer> *SavedInduction = Induction;
+      Induction = &Pointers;
+      StmtResult Body = TransformStmt(S->getBody());
+      Induction = SavedInduction;
+      Statements.push_back(SemaRef.ActOnForStmt(S->getForLoc(), S->getLParenLoc(), NULL, SemaRef.MakeFullExpr(Cond.get()), NULL,
+						SemaRef.MakeFullExpr(Inc.get()), S->getRParenLoc(), Body.get()).get());
+
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+    }
+    StmtResult TransformForStmt(ForStmt *S) {
+      if(Options.BulkLoopLimit && !Options.Instrument && !S->getConditionVariable()) {
+	StmtResult Result = TransformBulkForStmt(S);
+	if(Result.isUsable())
+	  return Result;
+      }
+      if(Options.InductionPointers && !S->getConditionVariable()) {
+	StmtResult Result = TransformInductionForStmt(S);
+	if(Result.isUsable())
+	  return Result;
+      }
+      return TreeTransformUPC::TransformForStmt(S);
+    }
+    // Relaxed reads in a statement whose addresses don't
+    // depend on other shared reads are started with
+    // non-blocking gets before the statement, and each one
+    // is synced just before its value is used.
+    typedef llvm::DenseMap<Expr*, std::pair<VarDecl*, VarDecl*> > SplitGetsType;
+    SplitGetsType *SplitGets;
+    void CollectSplitGets(Stmt *S, const LoopBodyInfo& Info, SmallVectorImpl<Expr*>& Reads) {
+      if(!S) return;
+      if(ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+	Expr *Sub = ICE->getSubExpr();
+	QualType Ty = Sub->getType();
+	if(ICE->getCastKind() == CK_LValueToRValue && Ty.getQualifiers().hasShared() &&
+	   !Ty.getQualifiers().hasStrict() && !isPrivatized(Sub) && !isBulkAccess(Sub) &&
+	   !FindCoalesced(Sub) && isStableBase(Sub, Info)) {
+	  Reads.push_back(Sub);
+	  return;
+	}
+      }
+      // Only operands that are always evaluated
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isLogicalOp()) {
+	  CollectSplitGets(BO->getLHS(), Info, Reads);
+	  return;
+	}
+      } else if(AbstractConditionalOperator *CO = dyn_cast<AbstractConditionalOperator>(S)) {
+	CollectSplitGets(CO->getCond(), Info, Reads);
+	return;
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	CollectSplitGets(*Children, Info, Reads);
+      }
+    }
+    // A relaxed value loaded by an earlier statement in the
+    // same compound statement that is still valid.
+    struct AvailableLoad {
+      Expr *LValue;
+      VarDecl *Tmp;
+    };
+    struct PlannedRead {
+      Expr *LValue;
+      VarDecl *Tmp;
+      unsigned Uses;
+      bool Reused;
+    };
+    // Decides how each relaxed read in S is loaded.  Identical
+    // reads share one load, and reads that are still available
+    // from earlier statements aren't loaded again.  The remaining
+    // loads are started together before S if there are several.
+    bool PlanStatementReads(Stmt *S, std::vector<AvailableLoad>& Available, SplitGetsType& Result, SmallVectorImpl<Stmt*>& Starts) {
+      if(!CanReadEarly(S))
+	return false;
+      LoopBodyInfo Info;
+      ScanLoopBody(S, Info, true);
+      SmallVector<Expr*, 4> Reads;
+      CollectSplitGets(S, Info, Reads);
+      // A store through a pointer may change the value
+      // between two identical reads
+      bool Reuse = Options.ReuseLoads && !HasIndirectStore(S);
+      std::vector<PlannedRead> Planned;
+      std::vector<unsigned> PlanOfRead;
+      unsigned NewLoads = 0;
+      for(SmallVectorImpl<Expr*>::const_iterator iter = Reads.begin(), end = Reads.end(); iter != end; ++iter) {
+	unsigned Index = Planned.size();
+	for(unsigned i = 0; Reuse && i < Planned.size(); ++i) {
+	  if(isSameExpr(Planned[i].LValue, *iter))
+	    Index = i;
+	}
+	if(Index == Planned.size()) {
+	  PlannedRead Read = { *iter, 0, 0, false };
+	  for(std::vector<AvailableLoad>::const_iterator A = Available.begin(), AEnd = Available.end(); Reuse && A != AEnd; ++A) {
+	    if(isSameExpr(A->LValue, *iter) && A->LValue->getType() == (*iter)->getType()) {
+	      Read.Tmp = A->Tmp;
+	      Read.Reused = true;
+	    }
+	  }
+	  if(!Read.Reused)
+	    ++NewLoads;
+	  Planned.push_back(Read);
+	}
+	++Planned[Index].Uses;
+	PlanOfRead.push_back(Index);
+      }
+      // A single read has nothing to overlap with
+      bool Split = Options.SplitPhaseGets && !Options.Instrument && NewLoads >= 2;
+      if(!Split && (!Reuse || Planned.empty()))
+	return false;
+      SmallVector<Stmt*, 4> Waits;
+      std::vector<VarDecl*> Handles(Planned.size());
+      for(unsigned i = 0; i < Planned.size(); ++i) {
+	PlannedRead& Read = Planned[i];
+	if(Read.Reused)
+	  continue;
+	QualType Ty = Read.LValue->getType();
+	Read.Tmp = CreateTmpVar(GetPrivateType(Ty));
+	std::vector<Expr*> args;
+	args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(Read.Tmp)).get());
+	args.push_back(TransformExpr(Read.LValue).get());
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
+	args.push_back(CreateInteger(SemaRef.Context.IntTy, (int)SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	bool Phaseless = isPhaseless(Ty);
+	NoteAccess(false, Ty.getQualifiers().hasStrict(), SemaRef.Context.getTypeSizeInChars(Ty).getQuantity());
+	if(Split) {
+	  VarDecl *Handle = CreateTmpVar(Decls->upcr_handle_t);
+	  Expr *Get = BuildUPCRCall(Phaseless? Decls->upcr_nb_get_pshared : Decls->upcr_nb_get_shared, args).get();
+	  Starts.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Handle), Get).get());
+	  // A handle can only be synced once
+	  if(Read.Uses > 1) {
+	    std::vector<Expr*> args;
+	    args.push_back(CreateSimpleDeclRef(Handle));
+	    Waits.push_back(BuildUPCRCall(Decls->upcr_wait_syncnb, args).get());
+	  } else {
+	    Handles[i] = Handle;
+	  }
+	} else if(Options.Instrument) {
+	  // The get is made before S is transformed
+	  SourceLocation SavedLoc = InstrumentLoc;
+	  if(S->getLocStart().isValid())
+	    InstrumentLoc = S->getLocStart();
+	  AddInstrumentArgs(args, 1);
+	  InstrumentLoc = SavedLoc;
+	  Starts.push_back(BuildUPCRCall(Phaseless? Decls->upcrt_gasp_get_pshared : Decls->upcrt_gasp_get_shared, args).get());
+	} else {
+	  Starts.push_back(BuildUPCRCall(Phaseless? Decls->UPCR_GET_PSHARED : Decls->UPCR_GET_SHARED, args).get());
+	}
+      }
+      Starts.append(Waits.begin(), Waits.end());
+      for(unsigned i = 0; i < Reads.size(); ++i) {
+	unsigned Index = PlanOfRead[i];
+	Result[Reads[i]] = std::make_pair(Planned[Index].Tmp, Handles[Index]);
+      }
+      // Everything loaded by S is available afterwards
+      for(unsigned i = 0; Reuse && i < Planned.size(); ++i) {
+	if(!Planned[i].Reused) {
+	  AvailableLoad Load = { Planned[i].LValue, Planned[i].Tmp };
+	  Available.push_back(Load);
+	}
+      }
+      return true;
+    }
+    // Drops the loads that S can invalidate
+    // Whether S stores anywhere but to a named private variable.
+    // Such a store may go through a local pointer to shared data.
+    static bool HasIndirectStore(Stmt *S) {
+      if(!S) return false;
+      Expr *LHS = 0;
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+	if(BO->isAssignmentOp())
+	  LHS = BO->getLHS();
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+	if(UO->isIncrementDecrementOp())
+	  LHS = UO->getSubExpr();
+      }
+      if(LHS) {
+	DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(LHS->IgnoreParens());
+	VarDecl *VD = DRE? dyn_cast<VarDecl>(DRE->getDecl()) : 0;
+	if(!VD || VD->getType().getQualifiers().hasShared())
+	  return true;
+      }
+      for(Stmt::child_range Children = S->children(); Children; ++Children) {
+	if(HasIndirectStore(*Children))
+	  return true;
+      }
+      return false;
+    }
+    void UpdateAvailableLoads(Stmt *S, std::vector<AvailableLoad>& Available) {
+      if(Available.empty())
+	return;
+      if((!isa<Expr>(S) && !isa<DeclStmt>(S)) || HasCoalesceBlocker(S) || HasIndirectStore(S)) {
+	Available.clear();
+	return;
+      }
+      LoopBodyInfo Info;
+      ScanLoopBody(S, Info, true);
+      for(std::vector<AvailableLoad>::iterator iter = Available.begin(); iter != Available.end();) {
+	std::set<VarDecl*> Vars;
+	CollectReferencedVars(iter->LValue, Vars);
+	bool Killed = false;
+	for(std::set<VarDecl*>::const_iterator V = Vars.begin(), VEnd = Vars.end(); V != VEnd; ++V) {
+	  if(Info.Modified.count(*V))
+	    Killed = true;
+	}
+	if(Killed)
+	  iter = Available.erase(iter);
+	else
+	  ++iter;
+      }
+    }
+    // (upcr_wait_syncnb(handle), tmp)
+    Expr *BuildSplitGetUse(Expr *E) {
+      if(!SplitGets)
+	return 0;
+      SplitGetsType::const_iterator pos = SplitGets->find(E);
+      if(pos == SplitGets->end())
+	return 0;
+      if(!pos->second.second)
+	return SemaRef.DefaultLvalueConversion(CreateSimpleDeclRef(pos->second.first)).get();
+      std::vector<Expr*> args;
+      args.push_back(CreateSimpleDeclRef(pos->second.second));
+      Expr *Wait = BuildUPCRCall(Decls->upcr_wait_syncnb, args).get();
+      return BuildParens(BuildComma(Wait, CreateSimpleDeclRef(pos->second.first)).get()).get();
+    }
+    ExprResult TransformCondition(Expr *E) {
+      ExprResult Result = TransformExpr(E);
+      if(isPointerToShared(E->getType())) {
+	bool Phaseless = isPhaseless(E->getType()->getAs<PointerType>()->getPointeeType());
+	std::vector<Expr*> args;
+	args.push_back(Result.get());
+	ExprResult Test = BuildUPCRCall(Phaseless?Decls->UPCR_ISNULL_PSHARED:Decls->UPCR_ISNULL_SHARED, args);
+	return SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_LNot, Test.get());
+      } else {
+	return Result;
+      }
+    }
+    StmtResult TransformIfStmt(IfStmt *S) {
+      // Transform the condition
+      ExprResult Cond;
+      VarDecl *ConditionVar = 0;
+      if (S->getConditionVariable()) {
+	ConditionVar
+	  = cast_or_null<VarDecl>(
+                       getDerived().TransformDefinition(
+                                          S->getConditionVariable()->getLocation(),
+                                                        S->getConditionVariable()));
+	if (!ConditionVar)
+	  return StmtError();
+      } else {
+	Cond = TransformCondition(S->getCond());
+	
+	if (Cond.isInvalid())
+	  return StmtError();
+	
+	// Convert the condition to a boolean value.
+	if (S->getCond()) {
+	  ExprResult CondE = getSema().ActOnBooleanCondition(0, S->getIfLoc(),
+							     Cond.get());
+	  if (CondE.isInvalid())
+	    return StmtError();
+	  
+	  Cond = CondE.get();
+	}
+      }
+      
+      Sema::FullExprArg FullCond(getSema().MakeFullExpr(Cond.take()));
       if (!S->getConditionVariable() && S->getCond() && !FullCond.get())
 	return StmtError();
       
@@ -1173,14 +3629,71 @@ namespace {
       bool SubStmtInvalid = false;
       bool SubStmtChanged = false;
       SmallVector<Stmt*, 8> Statements;
+      std::vector<AvailableLoad> AvailableLoads;
+      TmpScopes.push_back(std::vector<VarDecl*>());
+      std::size_t ScopeTemps = LiveTemps.size();
+      std::set<std::size_t> RemovedSyncs;
+      if(Options.removeSyncs())
+	PlanRedundantSyncs(S, RemovedSyncs);
+      // The wait would come after the last statement of a
+      // statement expression and change its value
+      std::vector<SplitBarrier> SplitBarriers;
+      if(Options.splitBarriers() && !IsStmtExpr)
+	PlanSplitBarriers(S, RemovedSyncs, SplitBarriers);
+      std::vector<SplitBarrier>::const_iterator NextSplit = SplitBarriers.begin();
+      // Where the statements generated for each statement of S start
+      std::vector<std::size_t> Starts;
       for (CompoundStmt::body_iterator B = S->body_begin(), BEnd = S->body_end();
 	   B != BEnd; ++B) {
+	std::size_t Index = B - S->body_begin();
+	Starts.push_back(Statements.size());
+	bool SplitHere = NextSplit != SplitBarriers.end() && Index >= NextSplit->Notify;
+	if(SplitHere && Index == NextSplit->Notify)
+	  Statements.push_back(BuildBarrierHalf(cast<UPCBarrierStmt>(S->body_begin()[NextSplit->Barrier]), Decls->upcr_notify));
+	if(RemovedSyncs.count(Index) || (SplitHere && Index == NextSplit->Barrier)) {
+	  // Dropped, or replaced by the notify and wait
+	  AvailableLoads.clear();
+	  if(SplitHere && Index == NextSplit->Wait) {
+	    Statements.push_back(BuildBarrierHalf(cast<UPCBarrierStmt>(S->body_begin()[NextSplit->Barrier]), Decls->upcr_wait));
+	    ++NextSplit;
+	  }
+	  continue;
+	}
+	std::size_t StmtTemps = LiveTemps.size();
+	std::vector<CoalescedStruct> *SavedCoalesced = Coalesced;
+	SplitGetsType *SavedSplitGets = SplitGets;
+	std::vector<CoalescedStruct> CoalescedReads;
+	SplitGetsType SplitReads;
+	SmallVector<Stmt*, 4> Fetches;
+	Coalesced = 0;
+	SplitGets = 0;
+	if(Options.CoalesceFieldReads && !Options.Instrument && FindCoalescedReads(*B, CoalescedReads, Fetches))
+	  Coalesced = &CoalescedReads;
+	if(PlanStatementReads(*B, AvailableLoads, SplitReads, Fetches))
+	  SplitGets = &SplitReads;
+	if(!Fetches.empty() && DeferringPuts) {
+	  // Only wait for the puts that the early reads may overlap
+	  std::vector<VarDecl*> Classes;
+	  for(std::vector<CoalescedStruct>::const_iterator iter = CoalescedReads.begin(), end = CoalescedReads.end(); iter != end; ++iter)
+	    Classes.push_back(iter->IsArrow? 0 : GetAccessClass(iter->Base));
+	  for(SplitGetsType::const_iterator iter = SplitReads.begin(), end = SplitReads.end(); iter != end; ++iter)
+	    Classes.push_back(GetAccessClass(iter->first));
+	  if(Expr *Sync = BuildPutSync(Classes))
+	    Fetches.insert(Fetches.begin(), Sync);
+	}
 	StmtResult Result = TransformStmt(*B);
+	Coalesced = SavedCoalesced;
+	SplitGets = SavedSplitGets;
+	UpdateAvailableLoads(*B, AvailableLoads);
+	ReleaseTemps(StmtTemps, AvailableLoads);
 	if (Result.isInvalid()) {
 	  // Immediately fail if this was a DeclStmt, since it's very
 	  // likely that this will cause problems for future statements.
-	  if (isa<DeclStmt>(*B))
+	  if (isa<DeclStmt>(*B)) {
+	    std::vector<VarDecl*> Declared;
+	    PopTmpScope(ScopeTemps, Declared);
 	    return StmtError();
+	  }
 
 	  // Otherwise, just keep processing substatements and fail later.
 	  SubStmtInvalid = true;
@@ -1192,13 +3705,25 @@ namespace {
 	// Insert extra statments first
 	Statements.append(SplitDecls.begin(), SplitDecls.end());
 	SplitDecls.clear();
+	Statements.append(Fetches.begin(), Fetches.end());
 
 	// Skip NullStmts.  Several transformations
 	// can generate them, and they aren't needed.
-	if(!Result.isInvalid() && isa<NullStmt>(Result.get()))
-	  continue;
+	if(!isa<NullStmt>(Result.get()))
+	  Statements.push_back(Result.takeAs<Stmt>());
+	if(SplitHere && Index == NextSplit->Wait) {
+	  Statements.push_back(BuildBarrierHalf(cast<UPCBarrierStmt>(S->body_begin()[NextSplit->Barrier]), Decls->upcr_wait));
+	  ++NextSplit;
+	}
+      }
+
+      Starts.push_back(Statements.size());
 
-	Statements.push_back(Result.takeAs<Stmt>());
+      std::vector<VarDecl*> Declared;
+      PopTmpScope(ScopeTemps, Declared);
+      SmallVector<Stmt*, 8> TmpDecls;
+      for(std::vector<VarDecl*>::const_iterator iter = Declared.begin(), end = Declared.end(); iter != end; ++iter) {
+	TmpDecls.push_back(CreateSimpleDeclStmt(*iter));
       }
 
       if (SubStmtInvalid)
@@ -1208,22 +3733,108 @@ namespace {
 	  !SubStmtChanged)
 	return SemaRef.Owned(S);
 
-      return getDerived().RebuildCompoundStmt(S->getLBracLoc(),
-					      Statements,
-					      S->getRBracLoc(),
-					      IsStmtExpr);
+      BlockEdit Edit;
+      if(Options.RewriteEngine) {
+	Edit.Prefix.assign(TmpDecls.begin(), TmpDecls.end());
+	for(std::size_t i = 0; i + 1 < Starts.size(); ++i)
+	  Edit.Pieces.push_back(std::vector<Stmt*>(Statements.begin() + Starts[i], Statements.begin() + Starts[i + 1]));
+      }
+      Statements.insert(Statements.begin(), TmpDecls.begin(), TmpDecls.end());
+      StmtResult Result = getDerived().RebuildCompoundStmt(S->getLBracLoc(),
+							   Statements,
+							   S->getRBracLoc(),
+							   IsStmtExpr);
+      if(Options.RewriteEngine && !Result.isInvalid()) {
+	Edit.Result = Result.get();
+	BlockEdits[S] = Edit;
+      }
+      return Result;
     }
+    // For the rewrite engine, what the translation made of
+    // each statement of a block
+    struct BlockEdit {
+      Stmt *Result;
+      // The temporaries declared at the start of the block
+      std::vector<Stmt*> Prefix;
+      // The statements generated for each statement of the
+      // block, in order.  Barriers and fences that were
+      // removed have none.
+      std::vector<std::vector<Stmt*> > Pieces;
+    };
+    std::map<CompoundStmt*, BlockEdit> BlockEdits;
+    // The statements that a function body is wrapped in
+    struct FunctionEdit {
+      std::vector<Stmt*> Prologue;
+      Stmt *UserBody;
+      std::vector<Stmt*> Epilogue;
+    };
+    std::map<FunctionDecl*, FunctionEdit> FunctionEdits;
     StmtResult TransformUPCPragmaStmt(UPCPragmaStmt *) {
       // #pragma upc should be stripped out
       return SemaRef.ActOnNullStmt(SourceLocation());
     }
+    // A temporary that is only used by the statement being
+    // transformed.  It is declared in the innermost block, and
+    // once the statement is done it can be handed out again.
     VarDecl *CreateTmpVar(QualType Ty) {
-      int ID = static_cast<int>(LocalTemps.size());
-      std::string name = (llvm::Twine("_bupc_spilld") + llvm::Twine(ID)).str();
-      VarDecl *TmpVar = VarDecl::Create(SemaRef.Context, SemaRef.getFunctionLevelDeclContext(), SourceLocation(), SourceLocation(), &SemaRef.Context.Idents.get(name), Ty, SemaRef.Context.getTrivialTypeSourceInfo(Ty), SC_None);
+      if(!Options.ScopedTemps || TmpScopes.empty())
+	return CreateFunctionTmpVar(Ty);
+      for(std::vector<VarDecl*>::iterator iter = FreeTemps.begin(), end = FreeTemps.end(); iter != end; ++iter) {
+	if(SemaRef.Context.hasSameType((*iter)->getType(), Ty)) {
+	  VarDecl *TmpVar = *iter;
+	  FreeTemps.erase(iter);
+	  LiveTemps.push_back(TmpVar);
+	  return TmpVar;
+	}
+      }
+      VarDecl *TmpVar = BuildTmpVar(Ty);
+      TmpScopes.back().push_back(TmpVar);
+      LiveTemps.push_back(TmpVar);
+      return TmpVar;
+    }
+    // A temporary declared at the top of the function
+    // that is never reused
+    VarDecl *CreateFunctionTmpVar(QualType Ty) {
+      VarDecl *TmpVar = BuildTmpVar(Ty);
       LocalTemps.push_back(TmpVar);
       return TmpVar;
     }
+    VarDecl *BuildTmpVar(QualType Ty) {
+      int ID = NextTmpID++;
+      std::string name = (llvm::Twine("_bupc_spilld") + llvm::Twine(ID)).str();
+      return VarDecl::Create(SemaRef.Context, SemaRef.getFunctionLevelDeclContext(), SourceLocation(), SourceLocation(), &SemaRef.Context.Idents.get(name), Ty, SemaRef.Context.getTrivialTypeSourceInfo(Ty), SC_None);
+    }
+    // Frees the temporaries allocated since Mark, except those
+    // that hold loads that later statements reuse.
+    void ReleaseTemps(std::size_t Mark, const std::vector<AvailableLoad>& Available) {
+      std::vector<VarDecl*> Pinned;
+      for(std::size_t i = Mark; i < LiveTemps.size(); ++i) {
+	bool InUse = false;
+	for(std::vector<AvailableLoad>::const_iterator iter = Available.begin(), end = Available.end(); iter != end; ++iter) {
+	  if(iter->Tmp == LiveTemps[i])
+	    InUse = true;
+	}
+	if(InUse)
+	  Pinned.push_back(LiveTemps[i]);
+	else
+	  FreeTemps.push_back(LiveTemps[i]);
+      }
+      LiveTemps.erase(LiveTemps.begin() + Mark, LiveTemps.end());
+      LiveTemps.insert(LiveTemps.end(), Pinned.begin(), Pinned.end());
+    }
+    // Ends the innermost block.  Its temporaries go out of scope.
+    void PopTmpScope(std::size_t Mark, std::vector<VarDecl*>& Declared) {
+      ReleaseTemps(Mark, std::vector<AvailableLoad>());
+      Declared.swap(TmpScopes.back());
+      TmpScopes.pop_back();
+      std::set<VarDecl*> OutOfScope(Declared.begin(), Declared.end());
+      std::vector<VarDecl*> StillFree;
+      for(std::vector<VarDecl*>::const_iterator iter = FreeTemps.begin(), end = FreeTemps.end(); iter != end; ++iter) {
+	if(!OutOfScope.count(*iter))
+	  StillFree.push_back(*iter);
+      }
+      FreeTemps.swap(StillFree);
+    }
     // Allow decls to be skipped
     StmtResult TransformDeclStmt(DeclStmt *S) {
       SmallVector<Decl *, 4> Decls;
@@ -1376,7 +3987,46 @@ namespace {
 	  Stmt *FnBody;
 	  {
 	    Sema::CompoundScopeRAII BodyScope(SemaRef);
+	    Stmt *SavedFunctionBody = CurrentFunctionBody;
+	    CurrentFunctionBody = FD->getBody();
+	    bool SavedFunctionIsMain = CurrentFunctionIsMain;
+	    CurrentFunctionIsMain = isMain;
+	    bool SavedDeferringPuts = DeferringPuts;
+	    std::vector<std::pair<VarDecl*, VarDecl*> > SavedPendingPuts;
+	    SavedPendingPuts.swap(PendingPuts);
+	    if(Options.DeferPuts) {
+	      std::vector<VarDecl*> Classes;
+	      std::vector<QualType> Types;
+	      CollectRelaxedStores(FD->getBody(), Classes, Types);
+	      // A put may still be pending when a local pointer
+	      // reads or writes the same memory.
+	      if(!Classes.empty() && (HasSharedToLocalCast(FD->getBody()) || HasAliasingLocalAccess(FD->getBody(), Types))) {
+		Remark(FD->getLocation(), "puts not deferred: '" + FD->getName() + "' may access their targets through local pointers");
+		Classes.clear();
+	      }
+	      for(std::vector<VarDecl*>::const_iterator iter = Classes.begin(), end = Classes.end(); iter != end; ++iter) {
+		PendingPuts.push_back(std::make_pair(*iter, CreateFunctionTmpVar(SemaRef.Context.IntTy)));
+	      }
+	    }
+	    DeferringPuts = !PendingPuts.empty();
+	    bool FunctionDefersPuts = DeferringPuts;
+	    bool SavedReusePlainC = ReusePlainC;
+	    if(Options.ReuseCSubtrees) {
+	      Usage.mark(FD->getBody());
+	      ReusePlainC = true;
+	    }
+	    if(Options.CommReport) {
+	      FunctionComm Comm = { FD->getName(), GetLine(SemaRef.getSourceManager().getExpansionLoc(FD->getLocation())), std::vector<CommSite>(), 0, std::vector<ForAllInfo>() };
+	      CommReport.push_back(Comm);
+	      CurrentComm = &CommReport.back();
+	    }
 	    Stmt *UserBody = TransformStmt(FD->getBody()).get();
+	    CurrentComm = 0;
+	    ReusePlainC = SavedReusePlainC;
+	    CurrentFunctionBody = SavedFunctionBody;
+	    CurrentFunctionIsMain = SavedFunctionIsMain;
+	    DeferringPuts = SavedDeferringPuts;
+	    Usage.clear();
 	    llvm::SmallVector<Stmt*, 8> Body;
 	    {
 	      std::vector<Expr*> args;
@@ -1388,10 +4038,31 @@ namespace {
 	      Body.push_back(SemaRef.ActOnDeclStmt(Sema::DeclGroupPtrTy::make(DeclGroupRef::Create(SemaRef.Context, decl_arr, 1)), SourceLocation(), SourceLocation()).get());
 	    }
 	    LocalTemps.clear();
+	    NextTmpID = 0;
+	    // No instrumented upc_forall is running on entry
+	    for(std::vector<VarDecl*>::const_iterator iter = ForAllFlags.begin(), end = ForAllFlags.end(); iter != end; ++iter) {
+	      Body.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(*iter), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	    }
+	    ForAllFlags.clear();
+	    // No puts are pending on entry
+	    for(std::vector<std::pair<VarDecl*, VarDecl*> >::const_iterator iter = PendingPuts.begin(), end = PendingPuts.end(); iter != end; ++iter) {
+	      Body.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(iter->second), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	    }
 	    // Insert the user code
+	    std::size_t UserBodyIndex = Body.size();
 	    Body.push_back(UserBody);
+	    // Complete any puts if the function falls off the end
+	    if(FunctionDefersPuts)
+	      Body.push_back(BuildPutSync());
+	    PendingPuts.swap(SavedPendingPuts);
 	    if(isMain)
 	      Body.push_back(SemaRef.ActOnReturnStmt(SourceLocation(), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	    if(Options.RewriteEngine) {
+	      FunctionEdit& Edit = FunctionEdits[FD];
+	      Edit.Prologue.assign(Body.begin(), Body.begin() + UserBodyIndex);
+	      Edit.UserBody = UserBody;
+	      Edit.Epilogue.assign(Body.begin() + UserBodyIndex + 1, Body.end());
+	    }
 	    FnBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Body, false).get();
 	  }
 	  SemaRef.ActOnFinishFunctionBody(result, FnBody);
@@ -1556,8 +4227,22 @@ namespace {
       return NULL;
     }
     std::set<StringRef> CollectedIncludes;
-    void PrintIncludes(llvm::raw_ostream& OS) {
+    // The collected headers that the main file includes itself
+    std::set<StringRef> DirectIncludes;
+    // For each user level declaration in the source, the
+    // declarations that it was translated into.  The
+    // generated allocation and initialization functions
+    // are at the end, with no source declaration.  Only
+    // recorded for the rewrite engine.
+    typedef std::vector<std::pair<Decl*, std::vector<Decl*> > > TopLevelDeclsType;
+    TopLevelDeclsType TopLevelDecls;
+    // The rewrite engine leaves the #include lines of the main
+    // file in place, so only the headers reached through the
+    // UPC headers have to be printed.
+    void PrintIncludes(llvm::raw_ostream& OS, bool SkipDirect = false) {
       for(std::set<StringRef>::iterator iter = CollectedIncludes.begin(), end = CollectedIncludes.end(); iter != end; ++iter) {
+	if(SkipDirect && DirectIncludes.count(*iter))
+	  continue;
 	StringRef relativeFilePath = *iter;
 	// Test successively larger paths until we
 	// find where the header comes from.
@@ -1599,17 +4284,27 @@ namespace {
       // Process all Decls
       for(DeclContext::decl_iterator iter = D->decls_begin(),
           end = D->decls_end(); iter != end; ++iter) {
+	double DeclStart = Options.TimeReport? llvm::TimeRecord::getCurrentTime(true).getWallTime() : 0;
 	Decl *decl = TransformDeclaration(*iter, result);
+	if(Options.TimeReport)
+	  DeclTimes.push_back(std::make_pair(llvm::TimeRecord::getCurrentTime(false).getWallTime() - DeclStart, *iter));
 	SourceManager& SrcManager = SemaRef.Context.getSourceManager();
 	SourceLocation Loc = SrcManager.getExpansionLoc((*iter)->getLocation());
 	// Don't output Decls declared in system headers
 	if(Loc.isInvalid() || !SrcManager.isInSystemHeader(Loc)) {
+	  std::vector<Decl*> Output;
 	  for(std::vector<Decl*>::const_iterator locals_iter = LocalStatics.begin(), locals_end = LocalStatics.end(); locals_iter != locals_end; ++locals_iter) {
-	    if(!(*locals_iter)->isImplicit())
+	    if(!(*locals_iter)->isImplicit()) {
 	      result->addDecl(*locals_iter);
+	      Output.push_back(*locals_iter);
+	    }
 	  }
-	  if(decl && !decl->isImplicit())
+	  if(decl && !decl->isImplicit()) {
 	    result->addDecl(decl);
+	    Output.push_back(decl);
+	  }
+	  if(Options.RewriteEngine)
+	    TopLevelDecls.push_back(std::make_pair(*iter, Output));
         } else {
 	  if(TreatAsCHeader(Loc)) {
 	    // Record the system headers included by user code
@@ -1623,6 +4318,8 @@ namespace {
 	    StringRef Name = SrcManager.getFilename(HeaderLoc);
 	    if(!Name.empty()) {
 	      CollectedIncludes.insert(Name);
+	      if(IncludeLoc.isValid() && SrcManager.getFileID(IncludeLoc) == SrcManager.getMainFileID())
+		DirectIncludes.insert(Name);
 	    }
           }
 	}
@@ -1631,19 +4328,33 @@ namespace {
 
       if(FunctionDecl *Alloc = GetSharedAllocationFunction()) {
 	result->addDecl(Alloc);
+	if(Options.RewriteEngine)
+	  TopLevelDecls.push_back(std::make_pair((Decl*)0, std::vector<Decl*>(1, Alloc)));
       }
       if(FunctionDecl *Init = GetSharedInitializationFunction()) {
 	result->addDecl(Init);
+	if(Options.RewriteEngine)
+	  TopLevelDecls.push_back(std::make_pair((Decl*)0, std::vector<Decl*>(1, Init)));
       }
       SemaRef.setCurScope(0);
       return result;
     }
+    // The wall time taken by each top-level declaration
+    // with --time-report
+    std::vector<std::pair<double, Decl*> > DeclTimes;
     std::map<Decl*, TypedefDecl*> ExtraAnonTagDecls;
     std::vector<Stmt*> SplitDecls;
     std::vector<Decl*> LocalStatics;
     UPCRDecls *Decls;
     std::string FileString;
     std::vector<VarDecl*> LocalTemps;
+    int NextTmpID;
+    // The temporaries first used in each enclosing block
+    std::vector<std::vector<VarDecl*> > TmpScopes;
+    // Temporaries used by statements that are still being transformed
+    std::vector<VarDecl*> LiveTemps;
+    // Temporaries in scope that can be reused
+    std::vector<VarDecl*> FreeTemps;
     // The shared variables that need to be initialized
     // all must have type upcr_shared_ptr_t
     // first = upcr_shared_ptr_t, second = original declaration
@@ -1652,6 +4363,69 @@ namespace {
     // have been processed
     typedef std::vector<std::pair<VarDecl*, VarDecl*> > SharedGlobalsType;
     std::vector<std::pair<VarDecl*, VarDecl*> > SharedGlobals;
+    // The variables left to the program-wide allocation table
+    std::vector<SharedAllocation> AllocManifest;
+    // Only definitions that other translation units can name
+    // can be allocated by the merged table.
+    static bool isInAllocManifest(VarDecl *VD) {
+      return VD->isFileVarDecl() && VD->hasExternalFormalLinkage() &&
+	VD->isThisDeclarationADefinition() != VarDecl::DeclarationOnly;
+    }
+    SharedAllocation GetSharedAllocation(VarDecl *Ptr, VarDecl *Orig) {
+      SharedAllocation Result;
+      Result.Name = Ptr->getName();
+      Result.Phaseless = (Ptr->getType() == Decls->upcr_pshared_ptr_t);
+      int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
+      int LayoutQualifier = Orig->getType().getQualifiers().getLayoutQualifier();
+      ArrayDimensionT Dims = GetArrayDimension(Orig->getType());
+      llvm::APInt ArrayDimension = Dims.ArrayDimension.zextOrTrunc(SizeTypeSize);
+      llvm::APInt ElementsInBlock = LayoutQualifier == 0? ArrayDimension : llvm::APInt(SizeTypeSize, LayoutQualifier);
+      Result.ElementSize = Dims.ElementSize;
+      Result.BlockBytes = ElementsInBlock.getZExtValue() * Result.ElementSize;
+      Result.NumBlocks = LayoutQualifier == 0? 1 :
+	(ArrayDimension + LayoutQualifier - 1).udiv(ElementsInBlock).getZExtValue();
+      Result.MultByThreads = Dims.HasThread;
+      Result.TypeString = GetSharedTypeString(Orig->getType());
+      return Result;
+    }
+    // Encodes the layout of a shared variable as
+    //   L<block size>_ then A<n>_ (A<n>T_ for n*THREADS) for each
+    //   dimension, then the element type mangled as in C++,
+    // e.g. shared [4] int a[10*THREADS] is L4_A10T_i.
+    std::string GetSharedTypeString(QualType Ty) {
+      std::string Result;
+      llvm::raw_string_ostream OS(Result);
+      OS << "L" << Ty.getQualifiers().getLayoutQualifier() << "_";
+      QualType ElemTy = Ty.getCanonicalType();
+      while(const ArrayType *AT = dyn_cast<ArrayType>(ElemTy.getTypePtr())) {
+	if(const ConstantArrayType *CAT = dyn_cast<ConstantArrayType>(AT)) {
+	  OS << "A" << CAT->getSize() << "_";
+	} else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
+	  OS << "A" << TAT->getSize() << (TAT->getThread()? "T" : "") << "_";
+	}
+	ElemTy = AT->getElementType();
+      }
+      // Mangle the private type that the runtime sees
+      ElemTy = TransformType(ElemTy.getUnqualifiedType()).getCanonicalType();
+      const RecordType *RT = ElemTy->getAs<RecordType>();
+      if(RT && !RT->getDecl()->getIdentifier() && !RT->getDecl()->getTypedefNameForAnonDecl()) {
+	OS << "Ut_";
+      } else {
+	std::string Mangled;
+	llvm::raw_string_ostream MangledOS(Mangled);
+	OwningPtr<MangleContext> Mangler(SemaRef.Context.createMangleContext());
+	Mangler->mangleCXXRTTIName(ElemTy, MangledOS);
+	// Drop the _ZTS prefix
+	OS << StringRef(MangledOS.str()).substr(4);
+      }
+      return OS.str();
+    }
+    void PrintAllocManifest(llvm::raw_ostream& OS) {
+      PrintAllocManifestHeader(OS);
+      for(std::vector<SharedAllocation>::const_iterator iter = AllocManifest.begin(), end = AllocManifest.end(); iter != end; ++iter) {
+	PrintAllocManifestEntry(*iter, OS);
+      }
+    }
     FunctionDecl* GetSharedAllocationFunction() {
       FunctionDecl *Result = Decls->CreateFunction(SemaRef.Context, "UPCRI_ALLOC_" + FileString, SemaRef.Context.VoidTy, 0, 0);
       SemaRef.ActOnStartOfFunctionDef(0, Result);
@@ -1664,6 +4438,15 @@ namespace {
 	  std::vector<Expr*> args;
 	  Statements.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args).get());
 	}
+	if(Options.StaticThreads) {
+	  // The sizes below assume THREADS == StaticThreads
+	  std::vector<Expr*> args;
+	  Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
+	  Expr *Mismatch = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_NE, Threads, CreateInteger(SemaRef.Context.IntTy, Options.StaticThreads)).get();
+	  std::vector<Expr*> exitargs;
+	  exitargs.push_back(CreateInteger(SemaRef.Context.IntTy, 1));
+	  Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(Mismatch), NULL, BuildUPCRCall(Decls->upcr_global_exit, exitargs).get(), SourceLocation(), NULL).get());
+	}
 	int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
 	QualType _bupc_info_type = SemaRef.Context.getIncompleteArrayType(Decls->upcr_startup_shalloc_t, ArrayType::Normal, 0);
 	QualType _bupc_pinfo_type = SemaRef.Context.getIncompleteArrayType(Decls->upcr_startup_pshalloc_t, ArrayType::Normal, 0);
@@ -1671,38 +4454,20 @@ namespace {
 	SmallVector<Expr*, 8> PInitializers;
 	for(SharedGlobalsType::const_iterator iter = SharedGlobals.begin(), end = SharedGlobals.end();
 	    iter != end; ++iter) {
+	  SharedAllocation Alloc = GetSharedAllocation(iter->first, iter->second);
+	  // Allocated by the merged table instead
+	  if(Options.AllocManifest && isInAllocManifest(iter->second)) {
+	    AllocManifest.push_back(Alloc);
+	    continue;
+	  }
 	  std::vector<Expr*> args;
-	  bool Phaseless = (iter->first->getType() == Decls->upcr_pshared_ptr_t);
+	  bool Phaseless = Alloc.Phaseless;
 	  args.push_back(SemaRef.BuildDeclRefExpr(iter->first, iter->first->getType(), VK_LValue, SourceLocation()).get());
-	  int LayoutQualifier = iter->second->getType().getQualifiers().getLayoutQualifier();
-	  llvm::APInt ArrayDimension(SizeTypeSize, 1);
-	  bool hasThread = false;
-	  QualType ElemTy = iter->second->getType().getCanonicalType();
-	  while(const ArrayType *AT = dyn_cast<ArrayType>(ElemTy.getTypePtr())) {
-	    if(const ConstantArrayType *CAT = dyn_cast<ConstantArrayType>(AT)) {
-	      ArrayDimension *= CAT->getSize();
-	    } else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
-	      if(TAT->getThread()) {
-		hasThread = true;
-	      }
-	      ArrayDimension *= TAT->getSize();
-	    } else {
-	      assert(!"Other array types should not syntax check");
-	    }
-	    ElemTy = AT->getElementType();
-	  }
-	  llvm::APInt ElementSize(SizeTypeSize, SemaRef.Context.getTypeSizeInChars(ElemTy).getQuantity());
-	  llvm::APInt ElementsInBlock = LayoutQualifier == 0? ArrayDimension : llvm::APInt(SizeTypeSize, LayoutQualifier);
-	  llvm::APInt BlockSize = ElementsInBlock * ElementSize;
-	  llvm::APInt NumBlocks = LayoutQualifier == 0?
-	    llvm::APInt(SizeTypeSize, 1) :
-	    (ArrayDimension + LayoutQualifier - 1).udiv(ElementsInBlock);
-	  args.push_back(IntegerLiteral::Create(SemaRef.Context, BlockSize, SemaRef.Context.getSizeType(), SourceLocation()));
-	  args.push_back(IntegerLiteral::Create(SemaRef.Context, NumBlocks, SemaRef.Context.getSizeType(), SourceLocation()));
-	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, hasThread), SemaRef.Context.getSizeType(), SourceLocation()));
-	  args.push_back(IntegerLiteral::Create(SemaRef.Context, ElementSize, SemaRef.Context.getSizeType(), SourceLocation()));
-	  // FIXME: encode the correct mangled type
-	  args.push_back(StringLiteral::Create(SemaRef.Context, "", StringLiteral::Ascii, false, SemaRef.Context.getPointerType(SemaRef.Context.getConstType(SemaRef.Context.CharTy)), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, Alloc.BlockBytes), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, Alloc.NumBlocks), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, Alloc.MultByThreads), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, Alloc.ElementSize), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(StringLiteral::Create(SemaRef.Context, Alloc.TypeString, StringLiteral::Ascii, false, SemaRef.Context.getPointerType(SemaRef.Context.getConstType(SemaRef.Context.CharTy)), SourceLocation()));
 	  if(Phaseless) {
 	    PInitializers.push_back(BuildUPCRCall(Decls->UPCRT_STARTUP_PSHALLOC, args).get());
 	  } else {
@@ -1758,6 +4523,29 @@ namespace {
       }
     }
 
+    VarDecl *GetOriginalSharedDecl(VarDecl *Ptr) {
+      for(SharedGlobalsType::const_iterator iter = SharedGlobals.begin(), end = SharedGlobals.end(); iter != end; ++iter) {
+	if(iter->first == Ptr)
+	  return iter->second;
+      }
+      llvm_unreachable("not a shared global");
+    }
+    // Fills this thread's blocks of the shared variable Ptr
+    // from Init, or with zeroes if Init is a null pointer.
+    Expr *BuildInitSharedBlocks(VarDecl *Ptr, Expr *Init, Expr *NumElements) {
+      VarDecl *VD = GetOriginalSharedDecl(Ptr);
+      int LayoutQualifier = VD->getType().getQualifiers().getLayoutQualifier();
+      std::vector<Expr*> args;
+      args.push_back(CreateSimpleDeclRef(Ptr));
+      args.push_back(Init);
+      args.push_back(CreateSize(GetArrayDimension(VD->getType()).ElementSize));
+      args.push_back(NumElements);
+      // An indefinite block holds the whole array
+      args.push_back(LayoutQualifier == 0? NumElements : CreateSize(LayoutQualifier));
+      bool Phaseless = Ptr->getType() == Decls->upcr_pshared_ptr_t;
+      return BuildUPCRCall(Phaseless? Decls->upcrt_init_pshared_blocks : Decls->upcrt_init_shared_blocks, args).get();
+    }
+
     typedef std::vector<std::pair<VarDecl *, Expr *> > DynamicInitializersType;
     DynamicInitializersType DynamicInitializers;
     typedef std::vector<std::pair<VarDecl *, std::pair<Expr *, QualType> > > SharedInitializersType;
@@ -1775,59 +4563,451 @@ namespace {
 	  Statements.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args).get());
 	}
 	
-	Expr *Cond;
-	{
-	  std::vector<Expr*> args;
-	  Expr *mythread = BuildUPCRCall(Decls->upcr_mythread, args).get();
-	  Cond = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, mythread, CreateInteger(SemaRef.Context.IntTy, 0)).get();
-	}
-
-	std::vector<VarDecl *> Initializers;
+	// Each thread copies its own blocks from read-only data
 	for(SharedInitializersType::iterator iter = SharedInitializers.begin(), end = SharedInitializers.end(); iter != end; ++iter) {
 	  std::string VarName = (Twine("_bupc_") + iter->first->getIdentifier()->getName() + "_val").str();
+	  QualType ValType = SemaRef.Context.getConstType(iter->second.second);
+	  // Initializers that the transformation turned into runtime
+	  // calls, e.g. the address of a shared variable, have to be
+	  // evaluated on the stack.
+	  bool IsConstant = iter->second.first->isConstantInitializer(SemaRef.Context, false);
 	  VarDecl *StoredInit = VarDecl::Create(SemaRef.Context, Result, SourceLocation(), SourceLocation(), &SemaRef.Context.Idents.get(VarName),
-						iter->second.second, SemaRef.Context.getTrivialTypeSourceInfo(iter->second.second),
-						SC_None);
+						ValType, SemaRef.Context.getTrivialTypeSourceInfo(ValType),
+						IsConstant? SC_Static : SC_None);
 	  StoredInit->setInit(iter->second.first);
-	  Initializers.push_back(StoredInit);
 	  Statements.push_back(CreateSimpleDeclStmt(StoredInit));
+	  Expr *Init = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(StoredInit)).get();
+	  uint64_t Size = SemaRef.Context.getTypeSizeInChars(ValType).getQuantity();
+	  Statements.push_back(BuildInitSharedBlocks(iter->first, Init, CreateSize(Size / GetArrayDimension(GetOriginalSharedDecl(iter->first)->getType()).ElementSize)));
+	}
+	// Large uninitialized arrays are zeroed by their owners
+	if(Options.FirstTouchLimit) {
+	  for(SharedGlobalsType::const_iterator iter = SharedGlobals.begin(), end = SharedGlobals.end(); iter != end; ++iter) {
+	    VarDecl *VD = iter->second;
+	    if(VD->hasInit() || VD->isThisDeclarationADefinition() == VarDecl::DeclarationOnly)
+	      continue;
+	    ArrayDimensionT Dims = GetArrayDimension(VD->getType());
+	    if(Dims.ArrayDimension.getZExtValue() * Dims.ElementSize < Options.FirstTouchLimit)
+	      continue;
+	    Expr *NumElements = CreateSize(Dims.ArrayDimension.getZExtValue());
+	    if(Dims.HasThread)
+	      NumElements = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, NumElements, BuildThreads()).get();
+	    Expr *Null = SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.VoidPtrTy), SourceLocation(), CreateInteger(SemaRef.Context.IntTy, 0)).get();
+	    Statements.push_back(BuildInitSharedBlocks(iter->first, Null, NumElements));
+	  }
 	}
-	
 	{
-	  SmallVector<Stmt*, 8> PutOnce;
-	  for(std::size_t i = 0; i < SharedInitializers.size(); ++i) {
-	    std::vector<Expr*> args;
-	    args.push_back(CreateSimpleDeclRef(SharedInitializers[i].first));
-	    args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
-	    args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(Initializers[i])).get());
-	    args.push_back(CreateInteger(SemaRef.Context.IntTy, SemaRef.Context.getTypeSizeInChars(Initializers[i]->getType()).getQuantity()));
-	    bool Phaseless = SharedInitializers[i].first->getType() == Decls->upcr_pshared_ptr_t;
-	    PutOnce.push_back(BuildUPCRCall(Phaseless?Decls->upcr_put_pshared:Decls->upcr_put_shared, args).get());
+	  for(std::size_t i = 0; i < DynamicInitializers.size(); ++i) {
+	    Expr *LHS = CreateSimpleDeclRef(DynamicInitializers[i].first);
+	    Expr *RHS = DynamicInitializers[i].second;
+	    Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LHS, RHS).get());
 	  }
-	  Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), SemaRef.MakeFullExpr(Cond), NULL, SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), PutOnce, false).get(), SourceLocation(), NULL).get());
 	}
-	{
-	  for(std::size_t i = 0; i < DynamicInitializers.size(); ++i) {
-	    Expr *LHS = CreateSimpleDeclRef(DynamicInitializers[i].first);
-	    Expr *RHS = DynamicInitializers[i].second;
-	    Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LHS, RHS).get());
-	  }
+
+	Body = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+      }
+      SemaRef.ActOnFinishFunctionBody(Result, Body.get());
+      return Result;
+    }
+  };
+
+  // The wall and CPU time and the change in malloc'd memory
+  // of each phase of one translation, for --time-report.
+  // The CPU time and memory are measured for the whole
+  // process, so they only describe one translation when no
+  // other translation runs at the same time.
+  class PhaseTimes {
+  public:
+    explicit PhaseTimes(bool Enabled) : Enabled(Enabled), Current(0) {}
+    void start(const char *Name) {
+      if(!Enabled)
+	return;
+      stop();
+      Current = Name;
+      Start = llvm::TimeRecord::getCurrentTime(true);
+    }
+    void stop() {
+      if(!Current)
+	return;
+      llvm::TimeRecord Elapsed = llvm::TimeRecord::getCurrentTime(false);
+      Elapsed -= Start;
+      Phases.push_back(std::make_pair(Current, Elapsed));
+      Current = 0;
+    }
+    typedef std::vector<std::pair<const char *, llvm::TimeRecord> > PhaseList;
+    const PhaseList& phases() const { return Phases; }
+  private:
+    bool Enabled;
+    const char *Current;
+    llvm::TimeRecord Start;
+    PhaseList Phases;
+  };
+
+  // The largest resident set size so far in kilobytes.  This
+  // covers everything the process has done, including earlier
+  // translations by a server.
+  static long GetPeakRSS() {
+    struct rusage Usage;
+    if(getrusage(RUSAGE_SELF, &Usage) != 0)
+      return 0;
+    return Usage.ru_maxrss;
+  }
+
+  // The #include and #pragma directives of the main file, for
+  // the rewrite engine.  The preprocessor knows which of them
+  // were seen, so commented out or #if 0'd lines are skipped.
+  class MainFileDirectives : public PPCallbacks {
+  public:
+    explicit MainFileDirectives(SourceManager& SM) : SrcManager(SM) {}
+    virtual void InclusionDirective(SourceLocation HashLoc, const Token &IncludeTok, StringRef FileName,
+				    bool IsAngled, CharSourceRange FilenameRange, const FileEntry *File,
+				    StringRef SearchPath, StringRef RelativePath, const Module *Imported) {
+      if(isInMainFile(HashLoc))
+	Includes.push_back(std::make_pair(HashLoc, FileName.str()));
+    }
+    virtual void PragmaDirective(SourceLocation Loc, PragmaIntroducerKind Introducer) {
+      if(Introducer == PIK_HashPragma && isInMainFile(Loc))
+	Pragmas.push_back(Loc);
+    }
+    std::vector<std::pair<SourceLocation, std::string> > Includes;
+    std::vector<SourceLocation> Pragmas;
+  private:
+    bool isInMainFile(SourceLocation Loc) {
+      return Loc.isFileID() && SrcManager.getFileID(Loc) == SrcManager.getMainFileID();
+    }
+    SourceManager& SrcManager;
+  };
+
+  // The rewrite engine.  Copies the main file, replacing only
+  // what the translation changed: the UPC headers and pragmas,
+  // the declarations that use shared types, and within the
+  // functions, the statements that use UPC.  Blocks and the
+  // bodies of if, for, while, do and switch statements whose
+  // header is unchanged are edited statement by statement, so
+  // the plain C around a shared access, upc_forall or barrier
+  // keeps its text, comments and macros.
+  class MainFileRewriter {
+  public:
+    MainFileRewriter(RemoveUPCTransform& T, ASTContext& NewContext) :
+      Trans(T), SrcManager(NewContext.getSourceManager()), LangOpts(NewContext.getLangOpts()),
+      Policy(NewContext.getPrintingPolicy()), MainFile(SrcManager.getMainFileID()) {}
+    // Writes the edited main file and then the generated
+    // declarations that have no place in it.  Returns false,
+    // without writing anything, if the file can't be edited
+    // in place because user declarations come from headers.
+    bool rewrite(const MainFileDirectives& Directives, llvm::raw_ostream& OS) {
+      std::vector<DeclGroup> Groups;
+      std::vector<Decl*> Trailing;
+      if(!GroupDecls(Groups, Trailing))
+	return false;
+
+      std::vector<TextEdit> Edits;
+      for(std::vector<DeclGroup>::const_iterator iter = Groups.begin(), end = Groups.end(); iter != end; ++iter) {
+	if(!iter->NeedsRewrite)
+	  continue;
+	FunctionDecl *FD = iter->Sources.size() == 1? dyn_cast<FunctionDecl>(iter->Sources[0]) : 0;
+	if(FD && FD->doesThisDeclarationHaveABody() && rewriteFunction(FD, iter->Output, Edits))
+	  continue;
+	unsigned Begin, End;
+	if(!getOffset(iter->Begin, Begin) || !getEndOffset(iter->End, iter->EndsWithSemi, End))
+	  return false;
+	std::string Text;
+	llvm::raw_string_ostream TextOS(Text);
+	printDecls(iter->Output, TextOS);
+	Edits.push_back(TextEdit(Begin, End - Begin, TextOS.str()));
+      }
+
+      // The C headers stay where they are, but the UPC headers
+      // and pragmas have to go, and some headers are renamed.
+      StringRef Buffer = SrcManager.getBufferData(MainFile);
+      for(std::vector<std::pair<SourceLocation, std::string> >::const_iterator iter = Directives.Includes.begin(), end = Directives.Includes.end(); iter != end; ++iter) {
+	unsigned Begin = SrcManager.getFileOffset(iter->first);
+	unsigned Length = getLineLength(Buffer, Begin);
+	std::map<StringRef, StringRef>::const_iterator pos = Trans.UPCHeaderRenames.find(iter->second);
+	if(Trans.UPCSystemHeaders.count(llvm::sys::path::filename(iter->second))) {
+	  Edits.push_back(TextEdit(Begin, Length, ""));
+	} else if(pos != Trans.UPCHeaderRenames.end()) {
+	  Edits.push_back(TextEdit(Begin, Length, ("#include <" + pos->second + ">").str()));
+	}
+      }
+      for(std::vector<SourceLocation>::const_iterator iter = Directives.Pragmas.begin(), end = Directives.Pragmas.end(); iter != end; ++iter) {
+	unsigned Begin = SrcManager.getFileOffset(*iter);
+	unsigned Length = getLineLength(Buffer, Begin);
+	StringRef Line = Buffer.substr(Begin, Length).ltrim();
+	if(!Line.startswith("#"))
+	  continue;
+	Line = Line.substr(1).ltrim();
+	if(!Line.startswith("pragma"))
+	  continue;
+	Line = Line.substr(6).ltrim();
+	if(Line.startswith("upc") || Line.startswith("pupc"))
+	  Edits.push_back(TextEdit(Begin, Length, ""));
+      }
+
+      Rewriter Rewrite(SrcManager, LangOpts);
+      SourceLocation FileStart = SrcManager.getLocForStartOfFile(MainFile);
+      for(std::vector<TextEdit>::const_iterator iter = Edits.begin(), end = Edits.end(); iter != end; ++iter) {
+	Rewrite.ReplaceText(FileStart.getLocWithOffset(iter->Offset), iter->Length, iter->Text);
+      }
+      if(const RewriteBuffer *Rewritten = Rewrite.getRewriteBufferFor(MainFile)) {
+	OS << std::string(Rewritten->begin(), Rewritten->end());
+      } else {
+	OS << Buffer;
+      }
+      OS << "\n";
+      printDecls(Trailing, OS);
+      return true;
+    }
+  private:
+    // Replaces Length bytes at Offset in the main file
+    struct TextEdit {
+      TextEdit(unsigned O, unsigned L, const std::string& T) : Offset(O), Length(L), Text(T) {}
+      unsigned Offset;
+      unsigned Length;
+      std::string Text;
+    };
+    // The declarations that share a declaration statement,
+    // e.g. struct S { ... } x, y;
+    struct DeclGroup {
+      SourceLocation Begin;
+      SourceLocation End;
+      bool EndsWithSemi;
+      bool NeedsRewrite;
+      std::vector<Decl*> Sources;
+      std::vector<Decl*> Output;
+    };
+    bool GroupDecls(std::vector<DeclGroup>& Groups, std::vector<Decl*>& Trailing) {
+      UPCUsageFinder Finder(Trans.Options.StaticThreads != 0);
+      for(RemoveUPCTransform::TopLevelDeclsType::const_iterator iter = Trans.TopLevelDecls.begin(), end = Trans.TopLevelDecls.end(); iter != end; ++iter) {
+	Decl *D = iter->first;
+	if(D == NULL) {
+	  Trailing.insert(Trailing.end(), iter->second.begin(), iter->second.end());
+	  continue;
+	}
+	if(D->isImplicit() || D->getLocation().isInvalid())
+	  continue;
+	SourceRange Range = D->getSourceRange();
+	if(!Range.getBegin().isFileID() || !Range.getEnd().isFileID() ||
+	   SrcManager.getFileID(Range.getBegin()) != MainFile)
+	  return false;
+	FunctionDecl *FD = dyn_cast<FunctionDecl>(D);
+	// Inline functions are made static
+	bool NeedsRewrite = Finder.declHasUPC(D) || iter->second.size() != 1 ||
+	  (FD && FD->isInlineSpecified());
+	bool EndsWithSemi = !(FD && FD->doesThisDeclarationHaveABody());
+	if(!Groups.empty() && Groups.back().Begin == Range.getBegin()) {
+	  DeclGroup& Group = Groups.back();
+	  if(SrcManager.isBeforeInTranslationUnit(Group.End, Range.getEnd()))
+	    Group.End = Range.getEnd();
+	  Group.NeedsRewrite = Group.NeedsRewrite || NeedsRewrite;
+	  Group.EndsWithSemi = EndsWithSemi;
+	  Group.Sources.push_back(D);
+	  Group.Output.insert(Group.Output.end(), iter->second.begin(), iter->second.end());
+	} else {
+	  DeclGroup Group;
+	  Group.Begin = Range.getBegin();
+	  Group.End = Range.getEnd();
+	  Group.EndsWithSemi = EndsWithSemi;
+	  Group.NeedsRewrite = NeedsRewrite;
+	  Group.Sources.push_back(D);
+	  Group.Output = iter->second;
+	  Groups.push_back(Group);
+	}
+      }
+      return true;
+    }
+    // Keeps the signature of a function whose type doesn't
+    // change and only edits its body.
+    bool rewriteFunction(FunctionDecl *FD, const std::vector<Decl*>& Output, std::vector<TextEdit>& Edits) {
+      std::map<FunctionDecl*, RemoveUPCTransform::FunctionEdit>::const_iterator Edit = Trans.FunctionEdits.find(FD);
+      CompoundStmt *Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+      unsigned Begin, Name, LBrac, RBrac;
+      if(Edit == Trans.FunctionEdits.end() || !Body || Output.empty() ||
+	 TypeHasUPC(FD->getType()) || FD->isInlineSpecified() ||
+	 !getOffset(FD->getSourceRange().getBegin(), Begin) || !getOffset(FD->getLocation(), Name) ||
+	 !getOffset(Body->getLBracLoc(), LBrac) || !getOffset(Body->getRBracLoc(), RBrac))
+	return false;
+      std::vector<TextEdit> Local;
+      // The shared statics of the function go before it
+      if(Output.size() > 1) {
+	std::string Text;
+	llvm::raw_string_ostream TextOS(Text);
+	printDecls(std::vector<Decl*>(Output.begin(), Output.end() - 1), TextOS);
+	Local.push_back(TextEdit(Begin, 0, TextOS.str()));
+      }
+      if(FD->getIdentifier() && FD->getIdentifier()->isStr("main"))
+	Local.push_back(TextEdit(Name, 4, "user_main"));
+      Local.push_back(TextEdit(LBrac + 1, 0, "\n" + print(Edit->second.Prologue)));
+      if(!rewriteBlock(Body, Edit->second.UserBody, Local))
+	return false;
+      if(!Edit->second.Epilogue.empty())
+	Local.push_back(TextEdit(RBrac, 0, print(Edit->second.Epilogue)));
+      Edits.insert(Edits.end(), Local.begin(), Local.end());
+      return true;
+    }
+    // Edits the statements of S that the translation changed
+    bool rewriteBlock(CompoundStmt *S, Stmt *Result, std::vector<TextEdit>& Edits) {
+      if(Result == S)
+	return true;
+      std::map<CompoundStmt*, RemoveUPCTransform::BlockEdit>::const_iterator Edit = Trans.BlockEdits.find(S);
+      unsigned LBrac, RBrac;
+      // The block may have been translated more than once,
+      // e.g. for the two versions of a bulk loop
+      if(Edit == Trans.BlockEdits.end() || Edit->second.Result != Result ||
+	 Edit->second.Pieces.size() != S->size() ||
+	 !getOffset(S->getLBracLoc(), LBrac) || !getOffset(S->getRBracLoc(), RBrac))
+	return false;
+      std::vector<TextEdit> Local;
+      if(!Edit->second.Prefix.empty())
+	Local.push_back(TextEdit(LBrac + 1, 0, "\n" + print(Edit->second.Prefix)));
+      for(std::size_t i = 0; i < S->size(); ++i) {
+	Stmt *Child = S->body_begin()[i];
+	const std::vector<Stmt*>& Piece = Edit->second.Pieces[i];
+	std::vector<Stmt*>::const_iterator Pos = std::find(Piece.begin(), Piece.end(), Child);
+	// Empty statements are dropped from the translation, but
+	// can just as well stay
+	if((Pos != Piece.end() && Piece.size() == 1) || (Piece.empty() && isa<NullStmt>(Child)))
+	  continue;
+	if(Pos == Piece.end() && Piece.size() == 1 && rewriteInPlace(Child, Piece[0], Local))
+	  continue;
+	unsigned Begin, End;
+	if(!getStmtRange(Child, Begin, End))
+	  return false;
+	if(Pos == Piece.end()) {
+	  Local.push_back(TextEdit(Begin, End - Begin, print(Piece)));
+	} else {
+	  // The statement is kept, with generated code around it,
+	  // e.g. the notify and wait of a split barrier
+	  if(Pos != Piece.begin())
+	    Local.push_back(TextEdit(Begin, 0, print(std::vector<Stmt*>(Piece.begin(), Pos))));
+	  if(Pos + 1 != Piece.end())
+	    Local.push_back(TextEdit(End, 0, "\n" + print(std::vector<Stmt*>(Pos + 1, Piece.end()))));
+	}
+      }
+      Edits.insert(Edits.end(), Local.begin(), Local.end());
+      return true;
+    }
+    // Keeps the text of a statement whose translation has
+    // the same structure, and only edits the blocks in it.
+    bool rewriteInPlace(Stmt *S, Stmt *Result, std::vector<TextEdit>& Edits) {
+      if(S == Result)
+	return true;
+      if(!S || !Result || S->getStmtClass() != Result->getStmtClass())
+	return false;
+      if(CompoundStmt *Block = dyn_cast<CompoundStmt>(S))
+	return rewriteBlock(Block, Result, Edits);
+      if(!isa<IfStmt>(S) && !isa<ForStmt>(S) && !isa<WhileStmt>(S) && !isa<DoStmt>(S) &&
+	 !isa<SwitchStmt>(S) && !isa<SwitchCase>(S) && !isa<LabelStmt>(S))
+	return false;
+      std::vector<TextEdit> Local;
+      Stmt::child_range Old = S->children();
+      Stmt::child_range New = Result->children();
+      for(; Old && New; ++Old, ++New) {
+	if(*Old == *New)
+	  continue;
+	if(!*Old || !*New)
+	  return false;
+	// A condition or loop header must come out the same
+	if(isa<Expr>(*Old) || isa<DeclStmt>(*Old)) {
+	  if(print(*Old) != print(*New))
+	    return false;
+	} else if(!rewriteInPlace(*Old, *New, Local)) {
+	  return false;
 	}
-
-	Body = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
       }
-      SemaRef.ActOnFinishFunctionBody(Result, Body.get());
-      return Result;
+      if(Old || New)
+	return false;
+      Edits.insert(Edits.end(), Local.begin(), Local.end());
+      return true;
+    }
+    std::string print(Stmt *S) {
+      return print(std::vector<Stmt*>(1, S));
+    }
+    std::string print(const std::vector<Stmt*>& Stmts) {
+      std::string Text;
+      llvm::raw_string_ostream OS(Text);
+      for(std::vector<Stmt*>::const_iterator iter = Stmts.begin(), end = Stmts.end(); iter != end; ++iter) {
+	(*iter)->printPretty(OS, 0, Policy);
+	if(isa<Expr>(*iter))
+	  OS << ";\n";
+      }
+      return OS.str();
+    }
+    void printDecls(const std::vector<Decl*>& Decls, llvm::raw_ostream& OS) {
+      for(std::vector<Decl*>::const_iterator iter = Decls.begin(), end = Decls.end(); iter != end; ++iter) {
+	(*iter)->print(OS, Policy);
+	FunctionDecl *FD = dyn_cast<FunctionDecl>(*iter);
+	if(!FD || !FD->doesThisDeclarationHaveABody())
+	  OS << ";";
+	OS << "\n";
+      }
+    }
+    bool getOffset(SourceLocation Loc, unsigned& Offset) {
+      if(!Loc.isFileID() || SrcManager.getFileID(Loc) != MainFile)
+	return false;
+      Offset = SrcManager.getFileOffset(Loc);
+      return true;
+    }
+    // The offset just after the token at Last, or after the
+    // semicolon that follows it
+    bool getEndOffset(SourceLocation Last, bool WithSemi, unsigned& Offset) {
+      if(!getOffset(Last, Offset))
+	return false;
+      SourceLocation After = Lexer::getLocForEndOfToken(Last, 0, SrcManager, LangOpts);
+      if(After.isInvalid())
+	return false;
+      if(WithSemi && *SrcManager.getCharacterData(Last) != ';') {
+	After = Lexer::findLocationAfterToken(Last, tok::semi, SrcManager, LangOpts, false);
+	if(After.isInvalid())
+	  return false;
+      }
+      Offset = SrcManager.getFileOffset(After);
+      return true;
     }
+    bool getStmtRange(Stmt *S, unsigned& Begin, unsigned& End) {
+      return getOffset(S->getLocStart(), Begin) && getEndOffset(S->getLocEnd(), endsWithSemi(S), End) && Begin <= End;
+    }
+    // Whether the source range of S stops short of the
+    // semicolon that ends it
+    static bool endsWithSemi(Stmt *S) {
+      if(IfStmt *If = dyn_cast<IfStmt>(S))
+	return endsWithSemi(If->getElse()? If->getElse() : If->getThen());
+      if(ForStmt *For = dyn_cast<ForStmt>(S))
+	return endsWithSemi(For->getBody());
+      if(WhileStmt *While = dyn_cast<WhileStmt>(S))
+	return endsWithSemi(While->getBody());
+      if(UPCForAllStmt *ForAll = dyn_cast<UPCForAllStmt>(S))
+	return endsWithSemi(ForAll->getBody());
+      if(SwitchStmt *Switch = dyn_cast<SwitchStmt>(S))
+	return endsWithSemi(Switch->getBody());
+      if(LabelStmt *Label = dyn_cast<LabelStmt>(S))
+	return endsWithSemi(Label->getSubStmt());
+      if(SwitchCase *Case = dyn_cast<SwitchCase>(S))
+	return endsWithSemi(Case->getSubStmt());
+      return !isa<CompoundStmt>(S);
+    }
+    static unsigned getLineLength(StringRef Buffer, unsigned Begin) {
+      std::size_t End = Buffer.find('\n', Begin);
+      return (End == StringRef::npos? Buffer.size() : End) - Begin;
+    }
+    RemoveUPCTransform& Trans;
+    SourceManager& SrcManager;
+    const LangOptions& LangOpts;
+    PrintingPolicy Policy;
+    FileID MainFile;
   };
 
   class RemoveUPCConsumer : public clang::SemaConsumer {
   public:
-    RemoveUPCConsumer(StringRef Output, StringRef FileString) : filename(Output), fileid(FileString) {}
+    RemoveUPCConsumer(StringRef Output, StringRef FileString, const UPCTransformOptions& Opts, llvm::raw_ostream *Remarks, const MainFileDirectives *D) : filename(Output), fileid(FileString), Options(Opts), RemarkOS(Remarks), Directives(D), Times(Opts.TimeReport) {
+      // The consumer is created just before the main file is parsed
+      Times.start("parse");
+    }
     virtual void HandleTranslationUnit(clang::ASTContext &Context) {
       if(Context.getDiagnostics().hasUncompilableErrorOccurred())
 	return;
 
+      Times.start("copy");
       TranslationUnitDecl *top = Context.getTranslationUnitDecl();
       // Copy the ASTContext and Sema
       LangOptions LangOpts = Context.getLangOpts();
@@ -1838,15 +5018,75 @@ namespace {
       ASTConsumer nullConsumer;
       UPCRDecls Decls(newContext);
       Sema newSema(S->getPreprocessor(), newContext, nullConsumer);
-      RemoveUPCTransform Trans(newSema, &Decls, fileid);
+      RemoveUPCTransform Trans(newSema, &Decls, fileid, Options);
+      if(Options.Remarks)
+	Trans.RemarkOS = RemarkOS;
+      Times.start("transform");
       Decl *Result = Trans.TransformTranslationUnitDecl(top);
+      if(Options.AllocManifest) {
+	std::string error;
+	llvm::raw_fd_ostream ManifestOS((filename + ".alloc").c_str(), error);
+	if(error.empty()) {
+	  Trans.PrintAllocManifest(ManifestOS);
+	} else {
+	  DiagnosticsEngine& Diag = Context.getDiagnostics();
+	  Diag.Report(Diag.getCustomDiagID(DiagnosticsEngine::Error, "cannot write allocation manifest '%0': %1"))
+	    << (filename + ".alloc") << error;
+	}
+      }
+      if(Options.CommReport) {
+	SmallString<256> ReportFile(filename);
+	llvm::sys::path::replace_extension(ReportFile, "comm.json");
+	std::string error;
+	llvm::raw_fd_ostream ReportOS(ReportFile.c_str(), error);
+	if(error.empty()) {
+	  Trans.PrintCommReport(ReportOS);
+	} else {
+	  DiagnosticsEngine& Diag = Context.getDiagnostics();
+	  Diag.Report(Diag.getCustomDiagID(DiagnosticsEngine::Error, "cannot write communication report '%0': %1"))
+	    << ReportFile.str() << error;
+	}
+      }
       std::string error;
       llvm::raw_fd_ostream OS(filename.c_str(), error);
+      bool Rewritten = false;
+      if(Options.RewriteEngine) {
+	Times.start("rewrite");
+	std::string Text;
+	llvm::raw_string_ostream TextOS(Text);
+	if(MainFileRewriter(Trans, newContext).rewrite(*Directives, TextOS)) {
+	  PrintPrologue(OS);
+	  Trans.PrintIncludes(OS, true);
+	  PrintExtraIncludes(OS);
+	  if(Options.Instrument)
+	    PrintInstrumentation(OS);
+	  OS << TextOS.str();
+	  Rewritten = true;
+	}
+      }
+      if(!Rewritten) {
+	Times.start("includes");
+	PrintPrologue(OS);
+	Trans.PrintIncludes(OS);
+	PrintExtraIncludes(OS);
+	if(Options.Instrument)
+	  PrintInstrumentation(OS);
+
+	Times.start("print");
+	Result->print(OS);
+      }
+      OS.flush();
+      Times.stop();
+      if(Options.TimeReport)
+	PrintTimeReport(Context, newContext, Trans);
+    }
+    void InitializeSema(Sema& SemaRef) { S = &SemaRef; }
+    void ForgetSema() { S = 0; }
+    static void PrintPrologue(llvm::raw_ostream& OS) {
       OS << "#include <upcr.h>\n";
       OS << "#include <upcr_proxy.h>\n";
-
-      Trans.PrintIncludes(OS);
-
+    }
+    static void PrintExtraIncludes(llvm::raw_ostream& OS) {
       OS << "#ifndef UPCR_TRANS_EXTRA_INCL\n"
 	"#define UPCR_TRANS_EXTRA_INCL\n"
 	"int32_t UPCR_TLD_DEFINE_TENTATIVE(upcrt_forall_control, 4, 4);\n"
@@ -1856,67 +5096,1212 @@ namespace {
 	"#define UPCRT_STARTUP_SHALLOC(sptr, blockbytes, numblocks, mult_by_threads, elemsz, typestr) \\\n"
 	"      { &(sptr), (blockbytes), (numblocks), (mult_by_threads), (elemsz), #sptr, (typestr) }\n"
 	"#define UPCRT_STARTUP_PSHALLOC UPCRT_STARTUP_SHALLOC\n"
+	"/* p + inc for a phased pointer with blocks of blk elements.  A step that stays in\n"
+	"   p's block keeps its thread, so only its phase and its address on that thread\n"
+	"   change.  Other steps are left to UPCR_ADD_SHARED. */\n"
+	"GASNETT_INLINE(upcrt_add_shared_blk)\n"
+	"upcr_shared_ptr_t upcrt_add_shared_blk(upcr_shared_ptr_t p, size_t elemsz, ptrdiff_t inc, size_t blk) {\n"
+	"  size_t phase = upcr_phaseof_shared(p) + (size_t)inc;\n"
+	"  if(phase < blk)\n"
+	"    return upcr_remote_to_shared_withphase((char *)upcr_shared_to_remote(p) + inc * (ptrdiff_t)elemsz, upcr_threadof_shared(p), phase);\n"
+	"  return UPCR_ADD_SHARED(p, elemsz, inc, blk);\n"
+	"}\n"
+	"/* the same, for blocks of 1 << blkshift elements */\n"
+	"GASNETT_INLINE(upcrt_add_shared_pow2)\n"
+	"upcr_shared_ptr_t upcrt_add_shared_pow2(upcr_shared_ptr_t p, size_t elemsz, ptrdiff_t inc, int blkshift) {\n"
+	"  size_t phase = upcr_phaseof_shared(p) + (size_t)inc;\n"
+	"  if(!(phase >> blkshift))\n"
+	"    return upcr_remote_to_shared_withphase((char *)upcr_shared_to_remote(p) + inc * (ptrdiff_t)elemsz, upcr_threadof_shared(p), phase);\n"
+	"  return UPCR_ADD_SHARED(p, elemsz, inc, (size_t)1 << blkshift);\n"
+	"}\n"
+	"/* Copies init, or zeroes if it is NULL, into the blocks of a shared array that this thread owns */\n"
+	"GASNETT_INLINE(upcrt_init_shared_blocks)\n"
+	"void upcrt_init_shared_blocks(upcr_shared_ptr_t p, const void *init, size_t elemsz, size_t nelems, size_t blk) {\n"
+	"  size_t threads = upcr_threads();\n"
+	"  size_t b = upcr_mythread();\n"
+	"  char *local;\n"
+	"  if(b * blk >= nelems) return;\n"
+	"  local = (char *)upcr_shared_to_local(upcr_add_shared(p, elemsz, b * blk, blk));\n"
+	"  for(; b * blk < nelems; b += threads, local += blk * elemsz) {\n"
+	"    size_t n = nelems - b * blk < blk ? nelems - b * blk : blk;\n"
+	"    if(init) memcpy(local, (const char *)init + b * blk * elemsz, n * elemsz);\n"
+	"    else memset(local, 0, n * elemsz);\n"
+	"  }\n"
+	"}\n"
+	"/* The same for cyclic (blk == 1) and indefinite (blk == nelems) arrays */\n"
+	"GASNETT_INLINE(upcrt_init_pshared_blocks)\n"
+	"void upcrt_init_pshared_blocks(upcr_pshared_ptr_t p, const void *init, size_t elemsz, size_t nelems, size_t blk) {\n"
+	"  size_t threads = upcr_threads();\n"
+	"  size_t b = upcr_mythread();\n"
+	"  char *local;\n"
+	"  if(b * blk >= nelems) return;\n"
+	"  local = (char *)upcr_pshared_to_local(blk == 1 ? upcr_add_pshared1(p, elemsz, b) : p);\n"
+	"  for(; b * blk < nelems; b += threads, local += blk * elemsz) {\n"
+	"    size_t n = nelems - b * blk < blk ? nelems - b * blk : blk;\n"
+	"    if(init) memcpy(local, (const char *)init + b * blk * elemsz, n * elemsz);\n"
+	"    else memset(local, 0, n * elemsz);\n"
+	"  }\n"
+	"}\n"
 	"#endif\n";
-
-      Result->print(OS);
     }
-    void InitializeSema(Sema& SemaRef) { S = &SemaRef; }
-    void ForgetSema() { S = 0; }
   private:
+    // Writes the phase times as a table to the diagnostics
+    // stream and as JSON to <stem>.trans.time.json
+    void PrintTimeReport(ASTContext& Context, ASTContext& newContext, RemoveUPCTransform& Trans) {
+      std::vector<std::pair<double, Decl*> >& DeclTimes = Trans.DeclTimes;
+      std::size_t Top = std::min<std::size_t>(Options.TimeReportTop, DeclTimes.size());
+      std::partial_sort(DeclTimes.begin(), DeclTimes.begin() + Top, DeclTimes.end(), std::greater<std::pair<double, Decl*> >());
+      long PeakRSS = GetPeakRSS();
+      SourceManager& SrcManager = Context.getSourceManager();
+      const PhaseTimes::PhaseList& Phases = Times.phases();
+
+      llvm::raw_ostream& OS = *RemarkOS;
+      OS << "===-- upc2c time report: " << filename << " --===\n";
+      OS << "   Wall (s)   User (s) System (s)   Mem (KB)  Phase\n";
+      llvm::TimeRecord Total;
+      for(PhaseTimes::PhaseList::const_iterator iter = Phases.begin(), end = Phases.end(); iter != end; ++iter) {
+	const llvm::TimeRecord& T = iter->second;
+	OS << llvm::format("%11.4f%11.4f%11.4f%11lld  ", T.getWallTime(), T.getUserTime(), T.getSystemTime(), (long long)(T.getMemUsed() / 1024)) << iter->first << "\n";
+	Total += T;
+      }
+      OS << llvm::format("%11.4f%11.4f%11.4f%11lld  ", Total.getWallTime(), Total.getUserTime(), Total.getSystemTime(), (long long)(Total.getMemUsed() / 1024)) << "total\n";
+      OS << "AST memory (KB): parsed " << Context.getASTAllocatedMemory() / 1024
+	 << ", translated " << newContext.getASTAllocatedMemory() / 1024 << "\n";
+      OS << "peak RSS (KB): " << PeakRSS << "\n";
+      if(Top != 0)
+	OS << "slowest top-level declarations:\n";
+      for(std::size_t i = 0; i < Top; ++i) {
+	Decl *D = DeclTimes[i].second;
+	PresumedLoc PLoc = SrcManager.getPresumedLoc(SrcManager.getExpansionLoc(D->getLocation()));
+	OS << llvm::format("%11.4f  ", DeclTimes[i].first);
+	if(PLoc.isValid())
+	  OS << PLoc.getFilename() << ":" << PLoc.getLine() << " ";
+	if(NamedDecl *ND = dyn_cast<NamedDecl>(D))
+	  OS << ND->getNameAsString();
+	OS << "\n";
+      }
+
+      SmallString<256> ReportFile(filename);
+      llvm::sys::path::replace_extension(ReportFile, "time.json");
+      std::string error;
+      llvm::raw_fd_ostream JSON(ReportFile.c_str(), error);
+      if(!error.empty()) {
+	DiagnosticsEngine& Diag = Context.getDiagnostics();
+	Diag.Report(Diag.getCustomDiagID(DiagnosticsEngine::Error, "cannot write time report '%0': %1"))
+	  << ReportFile.str() << error;
+	return;
+      }
+      JSON << "{\n  \"file\": ";
+      PrintJSONString(JSON, filename);
+      JSON << ",\n  \"phases\": [";
+      for(PhaseTimes::PhaseList::const_iterator iter = Phases.begin(), end = Phases.end(); iter != end; ++iter) {
+	const llvm::TimeRecord& T = iter->second;
+	JSON << (iter == Phases.begin()? "\n" : ",\n") << "    {\"name\": \"" << iter->first << "\""
+	     << llvm::format(", \"wall\": %.6f, \"user\": %.6f, \"system\": %.6f", T.getWallTime(), T.getUserTime(), T.getSystemTime())
+	     << ", \"malloc_bytes\": " << (long long)T.getMemUsed() << "}";
+      }
+      JSON << "\n  ],\n  \"ast_bytes\": {\"parsed\": " << (unsigned long long)Context.getASTAllocatedMemory()
+	   << ", \"translated\": " << (unsigned long long)newContext.getASTAllocatedMemory() << "},\n";
+      JSON << "  \"peak_rss_kb\": " << PeakRSS << ",\n";
+      JSON << "  \"slowest_decls\": [";
+      for(std::size_t i = 0; i < Top; ++i) {
+	Decl *D = DeclTimes[i].second;
+	PresumedLoc PLoc = SrcManager.getPresumedLoc(SrcManager.getExpansionLoc(D->getLocation()));
+	JSON << (i == 0? "\n" : ",\n") << "    {\"name\": ";
+	NamedDecl *ND = dyn_cast<NamedDecl>(D);
+	PrintJSONString(JSON, ND? ND->getNameAsString() : "");
+	JSON << ", \"file\": ";
+	PrintJSONString(JSON, PLoc.isValid()? PLoc.getFilename() : "");
+	JSON << ", \"line\": " << (PLoc.isValid()? PLoc.getLine() : 0)
+	     << llvm::format(", \"wall\": %.6f}", DeclTimes[i].first);
+      }
+      JSON << "\n  ]\n}\n";
+    }
+    // The hooks called for shared accesses, barriers and upc_forall
+    // with --instrument.  Each one reports GASP start and end events
+    // around the runtime call.  Define UPCRT_GASP_CONTEXT to the
+    // gasp_context_t of the tool if the runtime doesn't provide it.
+    void PrintInstrumentation(llvm::raw_ostream& OS) {
+      OS << "#ifndef UPCRT_GASP_INCL\n"
+	"#define UPCRT_GASP_INCL\n"
+	"#include <gasp_upc.h>\n"
+	"#ifndef UPCRT_GASP_CONTEXT\n"
+	"#define UPCRT_GASP_CONTEXT upcri_gaspctx\n"
+	"#endif\n"
+	"#ifndef UPCRT_GASP_SAMPLE\n"
+	"#define UPCRT_GASP_SAMPLE " << Options.InstrumentSample << "\n"
+	"#endif\n"
+	"uint32_t UPCR_TLD_DEFINE_TENTATIVE(upcrt_gasp_tick, 4, 4);\n"
+	"/* Whether to report this event.  The decision is made once per start/end pair. */\n"
+	"#define UPCRT_GASP_SAMPLED() (UPCRT_GASP_SAMPLE <= 1 || ++upcrt_gasp_tick % UPCRT_GASP_SAMPLE == 0)\n"
+	"GASNETT_INLINE(upcrt_gasp_get_shared)\n"
+	"void upcrt_gasp_get_shared(const char *file, int line, int relaxed, void *dst, upcr_shared_ptr_t src, size_t off, size_t n) {\n"
+	"  UPCR_BEGIN_FUNCTION();\n"
+	"  int sampled = UPCRT_GASP_SAMPLED();\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_GET, GASP_START, file, line, 0, relaxed, dst, &src, n);\n"
+	"  if(relaxed) UPCR_GET_SHARED(dst, src, off, n); else UPCR_GET_SHARED_STRICT(dst, src, off, n);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_GET, GASP_END, file, line, 0, relaxed, dst, &src, n);\n"
+	"}\n"
+	"GASNETT_INLINE(upcrt_gasp_get_pshared)\n"
+	"void upcrt_gasp_get_pshared(const char *file, int line, int relaxed, void *dst, upcr_pshared_ptr_t src, size_t off, size_t n) {\n"
+	"  UPCR_BEGIN_FUNCTION();\n"
+	"  int sampled = UPCRT_GASP_SAMPLED();\n"
+	"  upcr_shared_ptr_t gsrc = upcr_pshared_to_shared(src);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_GET, GASP_START, file, line, 0, relaxed, dst, &gsrc, n);\n"
+	"  if(relaxed) UPCR_GET_PSHARED(dst, src, off, n); else UPCR_GET_PSHARED_STRICT(dst, src, off, n);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_GET, GASP_END, file, line, 0, relaxed, dst, &gsrc, n);\n"
+	"}\n"
+	"/* mode is 0 for strict, 1 for relaxed and 2 for relaxed non-blocking puts */\n"
+	"GASNETT_INLINE(upcrt_gasp_put_shared)\n"
+	"void upcrt_gasp_put_shared(const char *file, int line, int mode, upcr_shared_ptr_t dst, size_t off, const void *src, size_t n) {\n"
+	"  UPCR_BEGIN_FUNCTION();\n"
+	"  int sampled = UPCRT_GASP_SAMPLED();\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_PUT, GASP_START, file, line, 0, mode != 0, &dst, src, n);\n"
+	"  if(mode == 0) UPCR_PUT_SHARED_STRICT(dst, off, src, n);\n"
+	"  else if(mode == 1) UPCR_PUT_SHARED(dst, off, src, n);\n"
+	"  else upcr_nbi_put_shared(dst, off, src, n);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_PUT, GASP_END, file, line, 0, mode != 0, &dst, src, n);\n"
+	"}\n"
+	"GASNETT_INLINE(upcrt_gasp_put_pshared)\n"
+	"void upcrt_gasp_put_pshared(const char *file, int line, int mode, upcr_pshared_ptr_t dst, size_t off, const void *src, size_t n) {\n"
+	"  UPCR_BEGIN_FUNCTION();\n"
+	"  int sampled = UPCRT_GASP_SAMPLED();\n"
+	"  upcr_shared_ptr_t gdst = upcr_pshared_to_shared(dst);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_PUT, GASP_START, file, line, 0, mode != 0, &gdst, src, n);\n"
+	"  if(mode == 0) UPCR_PUT_PSHARED_STRICT(dst, off, src, n);\n"
+	"  else if(mode == 1) UPCR_PUT_PSHARED(dst, off, src, n);\n"
+	"  else upcr_nbi_put_pshared(dst, off, src, n);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_PUT, GASP_END, file, line, 0, mode != 0, &gdst, src, n);\n"
+	"}\n"
+	"/* kind is 0 for upc_notify, 1 for upc_wait and 2 for upc_barrier */\n"
+	"GASNETT_INLINE(upcrt_gasp_sync)\n"
+	"void upcrt_gasp_sync(const char *file, int line, int kind, int id, int anonymous) {\n"
+	"  UPCR_BEGIN_FUNCTION();\n"
+	"  static const unsigned tags[] = { GASP_UPC_NOTIFY, GASP_UPC_WAIT, GASP_UPC_BARRIER };\n"
+	"  int sampled = UPCRT_GASP_SAMPLED();\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, tags[kind], GASP_START, file, line, 0, !anonymous, id);\n"
+	"  if(kind == 0) upcr_notify(id, anonymous);\n"
+	"  else if(kind == 1) upcr_wait(id, anonymous);\n"
+	"  else upcr_barrier(id, anonymous);\n"
+	"  if(sampled) gasp_event_notify(UPCRT_GASP_CONTEXT, tags[kind], GASP_END, file, line, 0, !anonymous, id);\n"
+	"}\n"
+	"/* upc_forall entry and exit are always reported */\n"
+	"GASNETT_INLINE(upcrt_gasp_forall)\n"
+	"void upcrt_gasp_forall(const char *file, int line, int start) {\n"
+	"  gasp_event_notify(UPCRT_GASP_CONTEXT, GASP_UPC_FORALL, start ? GASP_START : GASP_END, file, line, 0);\n"
+	"}\n"
+	"#endif\n";
+    }
     Sema *S;
     std::string filename;
     std::string fileid;
+    UPCTransformOptions Options;
+    llvm::raw_ostream *RemarkOS;
+    const MainFileDirectives *Directives;
+    PhaseTimes Times;
   };
 
   class RemoveUPCAction : public clang::ASTFrontendAction {
   public:
-    RemoveUPCAction(StringRef OutputFile, StringRef FileString) : filename(OutputFile), fileid(FileString) {}
+    RemoveUPCAction(StringRef OutputFile, StringRef FileString, const UPCTransformOptions& Opts, llvm::raw_ostream *Remarks) : filename(OutputFile), fileid(FileString), Options(Opts), RemarkOS(Remarks) {}
     virtual clang::ASTConsumer *CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-      return new RemoveUPCConsumer(filename, fileid);
+      Options.OptLevel = Compiler.getCodeGenOpts().OptimizationLevel;
+      // The preprocessor owns the callbacks and outlives the consumer
+      MainFileDirectives *Directives = 0;
+      if(Options.RewriteEngine) {
+	Directives = new MainFileDirectives(Compiler.getSourceManager());
+	Compiler.getPreprocessor().addPPCallbacks(Directives);
+      }
+      return new RemoveUPCConsumer(filename, fileid, Options, RemarkOS, Directives);
     }
     std::string filename;
     std::string fileid;
+    UPCTransformOptions Options;
+    llvm::raw_ostream *RemarkOS;
   };
 
-}
+  // Writes Contents to File through a temporary file and a
+  // rename, so that concurrent readers see either the old or
+  // the new contents, never a partial file.
+  bool WriteFileAtomically(StringRef File, StringRef Contents) {
+    SmallString<256> TempFile;
+    int FD;
+    if(llvm::sys::fs::createUniqueFile(File + ".tmp%%%%%%", FD, TempFile))
+      return false;
+    llvm::raw_fd_ostream OS(FD, true);
+    OS << Contents;
+    OS.close();
+    if(OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TempFile.str());
+      return false;
+    }
+    if(llvm::sys::fs::rename(TempFile.str(), File)) {
+      llvm::sys::fs::remove(TempFile.str());
+      return false;
+    }
+    return true;
+  }
 
-int main(int argc, const char ** argv) {
-  using namespace llvm::opt;
-  using namespace clang::driver;
-
-  // Parse the arguments
-  OwningPtr<OptTable> Opts(createDriverOptTable());
-  unsigned MissingArgIndex, MissingArgCount;
-  OwningPtr<InputArgList> Args(
-    Opts->ParseArgs(argv, argv + argc,MissingArgIndex, MissingArgCount));
-
-  // Read the input and output files and adjust the arguments
-  std::string InputFile = Args->getLastArgValue(options::OPT_INPUT);
-  std::string DefaultOutputFile = (llvm::sys::path::stem(InputFile) + ".trans.c").str();
-  std::string OutputFile = Args->getLastArgValue(options::OPT_o, DefaultOutputFile);
-  Args->eraseArg(options::OPT_o);
-
-  // Write the arguments to a vector
-  ArgStringList NewOptions;
-  for(ArgList::const_iterator iter = Args->begin(), end = Args->end(); iter != end; ++iter) {
-    // Always parse as UPC
-    if((*iter)->getOption().getID() == options::OPT_INPUT &&
-       iter != Args->begin()) {
-      NewOptions.push_back("-xupc");
-    }
-    (*iter)->renderAsInput(*Args, NewOptions);
+  // Builds a precompiled header for the leading run of
+  // #include <...> lines in a UPC source file.  Translating
+  // with -include-pch lets clang skip reparsing upc.h and
+  // the C library headers, and since the declarations keep
+  // their original locations, TreatAsCHeader and
+  // PrintIncludes see the same headers as before.
+  class GeneratePreambleAction : public GeneratePCHAction {
+  public:
+    GeneratePreambleAction(StringRef PCH, StringRef Temp, StringRef Deps)
+      : PCHFile(PCH), TempFile(Temp), DepsFile(Deps), Out(0) {}
+    ~GeneratePreambleAction() { delete Out; }
+    virtual ASTConsumer *CreateASTConsumer(CompilerInstance &CI, StringRef InFile) {
+      std::string Sysroot = CI.getHeaderSearchOpts().Sysroot;
+      if(!CI.getFrontendOpts().RelocatablePCH)
+	Sysroot.clear();
+      std::string Error;
+      Out = new llvm::raw_fd_ostream(TempFile.c_str(), Error, llvm::sys::fs::F_Binary);
+      if(!Error.empty())
+	return 0;
+      return new PCHGenerator(CI.getPreprocessor(), PCHFile, 0, Sysroot, Out);
+    }
+    virtual void EndSourceFileAction() {
+      if(!Out)
+	return;
+      Out->close();
+      if(getCompilerInstance().getDiagnostics().hasErrorOccurred()) {
+	llvm::sys::fs::remove(TempFile);
+	return;
+      }
+      // Other workers may be reading the old PCH
+      if(llvm::sys::fs::rename(TempFile, PCHFile)) {
+	llvm::sys::fs::remove(TempFile);
+	return;
+      }
+      // Record every file that went into the PCH, so that
+      // we can tell when it is out of date.  This is written
+      // last, so that the deps never describe a PCH that
+      // is not there yet.
+      std::string Deps;
+      SourceManager& SrcManager = getCompilerInstance().getSourceManager();
+      for(SourceManager::fileinfo_iterator iter = SrcManager.fileinfo_begin(), end = SrcManager.fileinfo_end(); iter != end; ++iter) {
+	Deps += iter->first->getName();
+	Deps += "\n";
+      }
+      WriteFileAtomically(DepsFile, Deps);
+    }
+  private:
+    std::string PCHFile;
+    std::string TempFile;
+    std::string DepsFile;
+    llvm::raw_fd_ostream *Out;
+  };
+
+  // Returns the #include <...> lines at the start of Source,
+  // skipping blank lines and comments.  Stops at the first
+  // line that is anything else, since a #define or a quoted
+  // include could change how the later headers are parsed.
+  // Also stops before upc_strict.h and upc_relaxed.h, whose
+  // #pragma upc has to apply to the main file.
+  std::string GetPreambleIncludes(StringRef Source) {
+    std::string Result;
+    bool InComment = false;
+    while(!Source.empty()) {
+      std::pair<StringRef, StringRef> Split = Source.split('\n');
+      StringRef Line = Split.first.trim();
+      Source = Split.second;
+      if(InComment) {
+	std::size_t End = Line.find("*/");
+	if(End == StringRef::npos)
+	  continue;
+	InComment = false;
+	Line = Line.substr(End + 2).trim();
+      }
+      if(Line.startswith("/*")) {
+	std::size_t End = Line.find("*/", 2);
+	if(End == StringRef::npos) {
+	  InComment = true;
+	  continue;
+	}
+	Line = Line.substr(End + 2).trim();
+      }
+      if(Line.empty() || Line.startswith("//"))
+	continue;
+      if(!Line.startswith("#"))
+	break;
+      StringRef Directive = Line.substr(1).ltrim();
+      if(!Directive.startswith("include"))
+	break;
+      StringRef Header = Directive.substr(7).trim();
+      if(!Header.startswith("<") || Header.find('>') == StringRef::npos)
+	break;
+      StringRef Name = llvm::sys::path::filename(Header.slice(1, Header.find('>')));
+      if(Name == "upc_strict.h" || Name == "upc_relaxed.h")
+	break;
+      Result += "#include ";
+      Result += Header.substr(0, Header.find('>') + 1);
+      Result += "\n";
+    }
+    return Result;
+  }
+
+  // Checks that none of the files listed in DepsFile is
+  // newer than the PCH.
+  bool IsPreambleUpToDate(StringRef PCHFile, StringRef DepsFile) {
+    llvm::sys::fs::file_status PCHStatus;
+    if(llvm::sys::fs::status(PCHFile, PCHStatus) || !llvm::sys::fs::exists(PCHStatus))
+      return false;
+    OwningPtr<llvm::MemoryBuffer> Deps;
+    if(llvm::MemoryBuffer::getFile(DepsFile, Deps))
+      return false;
+    StringRef Files = Deps->getBuffer();
+    while(!Files.empty()) {
+      std::pair<StringRef, StringRef> Split = Files.split('\n');
+      Files = Split.second;
+      if(Split.first.empty())
+	continue;
+      llvm::sys::fs::file_status Status;
+      if(llvm::sys::fs::status(Split.first, Status) || !llvm::sys::fs::exists(Status))
+	return false;
+      if(Status.getLastModificationTime() > PCHStatus.getLastModificationTime())
+	return false;
+    }
+    return true;
+  }
+
+  // Options understood by upc2c itself.  These are removed
+  // from the command line before it is handed to the clang driver.
+  struct TranslatorOptions {
+    TranslatorOptions() : Jobs(0) {}
+    // The number of files to translate concurrently.
+    // 0 means one per online processor.
+    unsigned Jobs;
+    // A compile_commands.json listing additional inputs
+    std::string CompileCommands;
+    // Run as a translation server listening on this socket
+    std::string ServerSocket;
+    // Forward the translation to the server listening on this socket
+    std::string ConnectSocket;
+    // Cache precompiled preambles in this directory
+    std::string PCHDir;
+    // Merge the allocation manifests given as inputs
+    // into one table written to this file
+    std::string MergeAlloc;
+    UPCTransformOptions Transform;
+  };
+
+  bool ParseTranslatorOptions(int argc, const char ** argv, TranslatorOptions& Opts,
+			      SmallVectorImpl<const char *>& DriverArgs) {
+    for(int i = 0; i < argc; ++i) {
+      StringRef Arg(argv[i]);
+      if(Arg.startswith("--jobs=")) {
+	if(Arg.substr(7).getAsInteger(10, Opts.Jobs)) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+      } else if(Arg.startswith("--compile-commands=")) {
+	Opts.CompileCommands = Arg.substr(19);
+      } else if(Arg.startswith("--server=")) {
+	Opts.ServerSocket = Arg.substr(9);
+      } else if(Arg.startswith("--connect=")) {
+	Opts.ConnectSocket = Arg.substr(10);
+      } else if(Arg.startswith("--pch-dir=")) {
+	Opts.PCHDir = Arg.substr(10);
+      } else if(Arg == "-fupc-reuse-c-subtrees") {
+	Opts.Transform.ReuseCSubtrees = true;
+      } else if(Arg == "-fno-upc-reuse-c-subtrees") {
+	Opts.Transform.ReuseCSubtrees = false;
+      } else if(Arg == "-fupc-strided-forall") {
+	Opts.Transform.StridedForAll = true;
+      } else if(Arg == "-fno-upc-strided-forall") {
+	Opts.Transform.StridedForAll = false;
+      } else if(Arg == "-fupc-privatize-forall") {
+	Opts.Transform.PrivatizeForAll = true;
+      } else if(Arg == "-fno-upc-privatize-forall") {
+	Opts.Transform.PrivatizeForAll = false;
+      } else if(Arg == "-fupc-coalesce-field-reads") {
+	Opts.Transform.CoalesceFieldReads = true;
+      } else if(Arg == "-fno-upc-coalesce-field-reads") {
+	Opts.Transform.CoalesceFieldReads = false;
+      } else if(Arg == "-fupc-split-phase-gets") {
+	Opts.Transform.SplitPhaseGets = true;
+      } else if(Arg == "-fno-upc-split-phase-gets") {
+	Opts.Transform.SplitPhaseGets = false;
+      } else if(Arg == "-fupc-reuse-loads") {
+	Opts.Transform.ReuseLoads = true;
+      } else if(Arg == "-fno-upc-reuse-loads") {
+	Opts.Transform.ReuseLoads = false;
+      } else if(Arg == "-fupc-defer-puts") {
+	Opts.Transform.DeferPuts = true;
+      } else if(Arg == "-fno-upc-defer-puts") {
+	Opts.Transform.DeferPuts = false;
+      } else if(Arg == "-fupc-inline-pointer-arithmetic") {
+	Opts.Transform.InlinePointerArithmetic = true;
+      } else if(Arg == "-fno-upc-inline-pointer-arithmetic") {
+	Opts.Transform.InlinePointerArithmetic = false;
+      } else if(Arg == "--remarks") {
+	Opts.Transform.Remarks = true;
+      } else if(Arg == "--instrument") {
+	Opts.Transform.Instrument = true;
+      } else if(Arg.startswith("--instrument-sample=")) {
+	if(Arg.substr(20).getAsInteger(10, Opts.Transform.InstrumentSample) || Opts.Transform.InstrumentSample == 0) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+	Opts.Transform.Instrument = true;
+      } else if(Arg == "--comm-report") {
+	Opts.Transform.CommReport = true;
+      } else if(Arg == "--time-report") {
+	Opts.Transform.TimeReport = true;
+      } else if(Arg.startswith("--time-report-top=")) {
+	if(Arg.substr(18).getAsInteger(10, Opts.Transform.TimeReportTop)) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+	Opts.Transform.TimeReport = true;
+      } else if(Arg == "--engine=rewrite") {
+	Opts.Transform.RewriteEngine = true;
+      } else if(Arg == "--engine=reprint") {
+	Opts.Transform.RewriteEngine = false;
+      } else if(Arg == "--alloc-manifest") {
+	Opts.Transform.AllocManifest = true;
+      } else if(Arg.startswith("--merge-alloc=")) {
+	Opts.MergeAlloc = Arg.substr(14);
+      } else if(Arg == "-fupc-remove-redundant-syncs") {
+	Opts.Transform.RemoveSyncs = 1;
+      } else if(Arg == "-fno-upc-remove-redundant-syncs") {
+	Opts.Transform.RemoveSyncs = 0;
+      } else if(Arg == "-fupc-split-barriers") {
+	Opts.Transform.SplitBarriers = 1;
+      } else if(Arg == "-fno-upc-split-barriers") {
+	Opts.Transform.SplitBarriers = 0;
+      } else if(Arg == "-fupc-scoped-temps") {
+	Opts.Transform.ScopedTemps = true;
+      } else if(Arg == "-fno-upc-scoped-temps") {
+	Opts.Transform.ScopedTemps = false;
+      } else if(Arg == "-fupc-induction-pointers") {
+	Opts.Transform.InductionPointers = true;
+      } else if(Arg == "-fno-upc-induction-pointers") {
+	Opts.Transform.InductionPointers = false;
+      } else if(Arg.startswith("-fupc-threads=")) {
+	if(Arg.substr(14).getAsInteger(10, Opts.Transform.StaticThreads) || Opts.Transform.StaticThreads == 0) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+      } else if(Arg.startswith("-fupc-first-touch=")) {
+	if(Arg.substr(18).getAsInteger(10, Opts.Transform.FirstTouchLimit)) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+      } else if(Arg.startswith("-fupc-bulk-loop-limit=")) {
+	if(Arg.substr(22).getAsInteger(10, Opts.Transform.BulkLoopLimit)) {
+	  llvm::errs() << "upc2c: invalid value in '" << Arg << "'\n";
+	  return false;
+	}
+      } else {
+	DriverArgs.push_back(argv[i]);
+      }
+    }
+    return true;
+  }
+
+  struct TranslationJob {
+    std::vector<std::string> Options;
+    std::string InputFile;
+    std::string OutputFile;
+    // Relative paths in Options are resolved against this directory
+    std::string WorkingDir;
+    // Where to cache precompiled preambles.  Empty to disable.
+    std::string PCHDir;
+    UPCTransformOptions TransformOptions;
+  };
+
+  // Makes Path absolute relative to Dir.  Dir may be empty,
+  // in which case paths are relative to the current directory.
+  std::string MakeAbsolute(StringRef Dir, StringRef Path) {
+    if(Dir.empty() || llvm::sys::path::is_absolute(Path))
+      return Path;
+    SmallString<256> Result(Dir);
+    llvm::sys::path::append(Result, Path);
+    return Result.str();
+  }
+
+  // Renders the arguments for translating Input.  Any other
+  // inputs are dropped, and the input is always parsed as UPC.
+  std::vector<std::string> GetTranslationOptions(const llvm::opt::InputArgList& Args, const llvm::opt::Arg *Input, StringRef WorkingDir) {
+    using namespace llvm::opt;
+    using namespace clang::driver;
+    ArgStringList NewOptions;
+    for(ArgList::const_iterator iter = Args.begin(), end = Args.end(); iter != end; ++iter) {
+      if((*iter)->getOption().getID() == options::OPT_INPUT &&
+	 iter != Args.begin()) {
+	if(*iter != Input)
+	  continue;
+	// The driver checks that the input exists
+	// relative to our working directory.
+	NewOptions.push_back("-xupc");
+	NewOptions.push_back(Args.MakeArgString(MakeAbsolute(WorkingDir, (*iter)->getValue())));
+	continue;
+      }
+      (*iter)->renderAsInput(Args, NewOptions);
+    }
+    // Disable CodeGen
+    NewOptions.push_back("-fsyntax-only");
+
+    // convert to std::string
+    return std::vector<std::string>(NewOptions.begin(), NewOptions.end());
+  }
+
+  // Creates a job for every input in Args.  Outputs with
+  // the default name are placed relative to OutputDir.
+  void AddTranslationJobs(const llvm::opt::InputArgList& Args, StringRef OutputFile, StringRef WorkingDir, StringRef OutputDir, std::vector<TranslationJob>& Jobs) {
+    using namespace llvm::opt;
+    using namespace clang::driver;
+    for(ArgList::const_iterator iter = Args.begin(), end = Args.end(); iter != end; ++iter) {
+      if((*iter)->getOption().getID() != options::OPT_INPUT ||
+	 iter == Args.begin())
+	continue;
+      TranslationJob Job;
+      Job.Options = GetTranslationOptions(Args, *iter, WorkingDir);
+      Job.InputFile = (*iter)->getValue();
+      Job.OutputFile = MakeAbsolute(OutputDir, OutputFile.empty()?
+	(llvm::sys::path::stem(Job.InputFile) + ".trans.c").str() : OutputFile.str());
+      Job.WorkingDir = WorkingDir;
+      Jobs.push_back(Job);
+    }
   }
-  // Disable CodeGen
-  NewOptions.push_back("-fsyntax-only");
 
-  // convert to std::string
-  std::vector<std::string> options(NewOptions.begin(), NewOptions.end());
+  // Keeps one FileManager per working directory, so that
+  // the stat cache is reused from one translation to the next.
+  class FileManagerCache {
+  public:
+    FileManagerCache() {}
+    ~FileManagerCache() {
+      clear();
+    }
+    void clear() {
+      for(std::map<std::string, FileManager *>::iterator iter = Files.begin(), end = Files.end(); iter != end; ++iter) {
+	delete iter->second;
+      }
+      Files.clear();
+    }
+    // Drops the FileManagers that have seen a file whose size
+    // or modification time has changed since, or that has been
+    // removed.  The others are kept with all their entries.
+    void revalidate() {
+      for(std::map<std::string, FileManager *>::iterator iter = Files.begin(), end = Files.end(); iter != end;) {
+	if(isCurrent(iter->first, iter->second)) {
+	  ++iter;
+	} else {
+	  delete iter->second;
+	  Files.erase(iter++);
+	}
+      }
+    }
+    FileManager *get(const std::string& WorkingDir) {
+      FileManager *& FM = Files[WorkingDir];
+      if(FM == NULL) {
+	FileSystemOptions FSOpts;
+	FSOpts.WorkingDir = WorkingDir;
+	FM = new FileManager(FSOpts);
+      }
+      return FM;
+    }
+  private:
+    static bool isCurrent(StringRef WorkingDir, FileManager *FM) {
+      SmallVector<const FileEntry *, 64> Entries;
+      FM->GetUniqueIDMapping(Entries);
+      for(SmallVectorImpl<const FileEntry *>::const_iterator iter = Entries.begin(), end = Entries.end(); iter != end; ++iter) {
+	if(*iter == NULL)
+	  continue;
+	llvm::sys::fs::file_status Status;
+	if(llvm::sys::fs::status(MakeAbsolute(WorkingDir, (*iter)->getName()), Status) ||
+	   Status.getSize() != uint64_t((*iter)->getSize()) ||
+	   time_t(Status.getLastModificationTime().toEpochTime()) != (*iter)->getModificationTime())
+	  return false;
+      }
+      return true;
+    }
+    FileManagerCache(const FileManagerCache&);
+    void operator=(const FileManagerCache&);
+    std::map<std::string, FileManager *> Files;
+  };
+
+  // Returns the precompiled preamble to use for Job, building
+  // it if necessary.  The PCH is keyed on the options and the
+  // included headers, and is rebuilt when any file that went
+  // into it changes.  Returns an empty string if the input has
+  // no preamble or the PCH could not be built.
+  std::string GetPreamblePCH(const TranslationJob& Job, FileManager *Files, llvm::raw_ostream *Diags) {
+    std::vector<std::string>::const_iterator Input = std::find(Job.Options.begin(), Job.Options.end(), "-xupc");
+    if(Input == Job.Options.end() || Input + 1 == Job.Options.end())
+      return "";
+    ++Input;
+    OwningPtr<llvm::MemoryBuffer> Source;
+    if(llvm::MemoryBuffer::getFile(*Input, Source))
+      return "";
+    std::string Includes = GetPreambleIncludes(Source->getBuffer());
+    if(Includes.empty())
+      return "";
+
+    llvm::MD5 Hash;
+    for(std::vector<std::string>::const_iterator iter = Job.Options.begin(), end = Job.Options.end(); iter != end; ++iter) {
+      if(iter != Input) {
+	Hash.update(*iter);
+	Hash.update(StringRef("", 1));
+      }
+    }
+    Hash.update(Job.WorkingDir);
+    Hash.update(StringRef("", 1));
+    Hash.update(Includes);
+    llvm::MD5::MD5Result Digest;
+    Hash.final(Digest);
+    SmallString<32> Key;
+    llvm::MD5::stringifyResult(Digest, Key);
+
+    std::string Base = MakeAbsolute(Job.PCHDir, ("upc2c-" + Key).str());
+    std::string HeaderFile = Base + ".h";
+    std::string PCHFile = Base + ".pch";
+    std::string DepsFile = Base + ".deps";
+    if(IsPreambleUpToDate(PCHFile, DepsFile))
+      return PCHFile;
+
+    // The header only depends on the key, so an existing one
+    // is left alone.  Rewriting it would make every PCH built
+    // from it look out of date.
+    llvm::sys::fs::create_directories(Job.PCHDir);
+    if(!llvm::sys::fs::exists(HeaderFile) && !WriteFileAtomically(HeaderFile, Includes))
+      return "";
+    std::vector<std::string> Options(Job.Options);
+    Options[Input - Job.Options.begin()] = HeaderFile;
+    std::string TempFile = (PCHFile + ".tmp" + llvm::Twine(getpid()) + "." + llvm::Twine(reinterpret_cast<uintptr_t>(&Options))).str();
+    ToolInvocation tool(Options, new GeneratePreambleAction(PCHFile, TempFile, DepsFile), Files);
+    bool Success;
+    if(Diags) {
+      TextDiagnosticPrinter Printer(*Diags, new DiagnosticOptions());
+      tool.setDiagnosticConsumer(&Printer);
+      Success = tool.run();
+    } else {
+      Success = tool.run();
+    }
+    if(!Success || !llvm::sys::fs::exists(PCHFile))
+      return "";
+    return PCHFile;
+  }
+
+  // Diags receives the compiler diagnostics.  If it is NULL,
+  // they go to stderr.
+  bool RunTranslationJob(const TranslationJob& Job, FileManager *Files, llvm::raw_ostream *Diags) {
+    if(!Job.PCHDir.empty()) {
+      std::string PCHFile = GetPreamblePCH(Job, Files, Diags);
+      if(!PCHFile.empty()) {
+	TranslationJob WithPCH(Job);
+	WithPCH.PCHDir.clear();
+	std::vector<std::string>::iterator Input = std::find(WithPCH.Options.begin(), WithPCH.Options.end(), "-xupc");
+	const char *IncludePCH[] = { "-include-pch", PCHFile.c_str() };
+	WithPCH.Options.insert(Input, IncludePCH, IncludePCH + 2);
+	// If the PCH can't be used, e.g. because another worker
+	// replaced it, translate again without it and only
+	// report the diagnostics of the second attempt.
+	std::string Output;
+	llvm::raw_string_ostream OS(Output);
+	bool Success = RunTranslationJob(WithPCH, Files, &OS);
+	OS.flush();
+	if(Success) {
+	  (Diags? *Diags : llvm::errs()) << Output;
+	  return true;
+	}
+      }
+    }
+    ToolInvocation tool(Job.Options, new RemoveUPCAction(Job.OutputFile, get_file_id(Job.InputFile), Job.TransformOptions, Diags? Diags : &llvm::errs()), Files);
+    if(Diags) {
+      TextDiagnosticPrinter Printer(*Diags, new DiagnosticOptions());
+      tool.setDiagnosticConsumer(&Printer);
+      return tool.run();
+    } else {
+      return tool.run();
+    }
+  }
+
+  // Hands out translation jobs to a pool of worker threads.
+  // FileManager is not thread safe, so each worker keeps its
+  // own, which is reused for every file that the worker
+  // translates.  This way the stat cache for the system and
+  // UPC headers is only populated once per worker.
+  class TranslationQueue {
+  public:
+    TranslationQueue(const std::vector<TranslationJob>& J, llvm::raw_ostream *D) : Jobs(J), Diags(D), Next(0), Failures(0) {}
+    // Returns the number of jobs that failed.  If Files is
+    // not NULL, it is used when running on a single thread.
+    unsigned run(unsigned NumThreads, FileManagerCache *Files = NULL) {
+      if(NumThreads > Jobs.size())
+	NumThreads = Jobs.size();
+      if(NumThreads <= 1) {
+	process(Files);
+	return Failures;
+      }
+      // The ManagedStatics in LLVM are only guarded once
+      // multithreading has been turned on.
+      if(!llvm::llvm_is_multithreaded())
+	llvm::llvm_start_multithreaded();
+      // Clang recurses deeply, so give the workers
+      // the same stack that the main thread would get.
+      pthread_attr_t Attr;
+      pthread_attr_init(&Attr);
+      pthread_attr_setstacksize(&Attr, 8 << 20);
+      std::vector<pthread_t> Threads;
+      for(unsigned i = 0; i < NumThreads; ++i) {
+	pthread_t Thread;
+	if(pthread_create(&Thread, &Attr, &TranslationQueue::worker, this) == 0) {
+	  Threads.push_back(Thread);
+	}
+      }
+      pthread_attr_destroy(&Attr);
+      if(Threads.empty()) {
+	process(Files);
+      }
+      for(std::size_t i = 0; i < Threads.size(); ++i) {
+	pthread_join(Threads[i], NULL);
+      }
+      return Failures;
+    }
+  private:
+    static void *worker(void *Self) {
+      static_cast<TranslationQueue *>(Self)->process(NULL);
+      return NULL;
+    }
+    const TranslationJob *take() {
+      llvm::MutexGuard Guard(Lock);
+      if(Next == Jobs.size())
+	return NULL;
+      return &Jobs[Next++];
+    }
+    void process(FileManagerCache *Shared) {
+      FileManagerCache Local;
+      FileManagerCache& Files = Shared? *Shared : Local;
+      while(const TranslationJob *Job = take()) {
+	std::string Output;
+	llvm::raw_string_ostream OS(Output);
+	bool Success = RunTranslationJob(*Job, Files.get(Job->WorkingDir), Diags? &OS : NULL);
+	OS.flush();
+	llvm::MutexGuard Guard(Lock);
+	if(!Success)
+	  ++Failures;
+	if(Diags)
+	  *Diags << Output;
+      }
+    }
+    const std::vector<TranslationJob>& Jobs;
+    llvm::raw_ostream *Diags;
+    std::size_t Next;
+    unsigned Failures;
+    llvm::sys::Mutex Lock;
+  };
+
+  // Combines the manifests written by --alloc-manifest into a
+  // single UPCRI_ALLOC function, so that the runtime sets up all
+  // the shared variables of the program with one call per table.
+  int MergeAllocManifests(StringRef OutputFile, ArrayRef<const char *> Inputs, StringRef WorkingDir,
+			  llvm::raw_ostream& Errs) {
+    std::vector<SharedAllocation> Allocs;
+    std::map<std::string, size_t> Index;
+    for(ArrayRef<const char *>::iterator iter = Inputs.begin(), end = Inputs.end(); iter != end; ++iter) {
+      OwningPtr<llvm::MemoryBuffer> Buffer;
+      std::vector<SharedAllocation> FileAllocs;
+      if(llvm::MemoryBuffer::getFile(MakeAbsolute(WorkingDir, *iter), Buffer) ||
+	 !ParseAllocManifest(Buffer->getBuffer(), FileAllocs)) {
+	Errs << "upc2c: cannot read allocation manifest '" << *iter << "'\n";
+	return EXIT_FAILURE;
+      }
+      for(std::vector<SharedAllocation>::const_iterator alloc = FileAllocs.begin(), alloc_end = FileAllocs.end(); alloc != alloc_end; ++alloc) {
+	std::map<std::string, size_t>::const_iterator pos = Index.find(alloc->Name);
+	if(pos == Index.end()) {
+	  Index.insert(std::make_pair(alloc->Name, Allocs.size()));
+	  Allocs.push_back(*alloc);
+	} else if(!(Allocs[pos->second] == *alloc)) {
+	  Errs << "upc2c: conflicting layouts for shared variable '" << alloc->Name << "' in '" << *iter << "'\n";
+	  return EXIT_FAILURE;
+	}
+      }
+    }
+
+    std::string Output = MakeAbsolute(WorkingDir, OutputFile);
+    std::string error;
+    llvm::raw_fd_ostream OS(Output.c_str(), error);
+    if(!error.empty()) {
+      Errs << "upc2c: " << error << "\n";
+      return EXIT_FAILURE;
+    }
+    RemoveUPCConsumer::PrintPrologue(OS);
+    RemoveUPCConsumer::PrintExtraIncludes(OS);
+    for(std::vector<SharedAllocation>::const_iterator iter = Allocs.begin(), end = Allocs.end(); iter != end; ++iter) {
+      OS << "extern " << (iter->Phaseless? "upcr_pshared_ptr_t " : "upcr_shared_ptr_t ") << iter->Name << ";\n";
+    }
+    OS << "void UPCRI_ALLOC_" << get_file_id(Output) << "() {\n";
+    OS << "    UPCR_BEGIN_FUNCTION();\n";
+    for(int Phaseless = 0; Phaseless < 2; ++Phaseless) {
+      const char *Table = Phaseless? "_bupc_pinfo" : "_bupc_info";
+      unsigned Count = 0;
+      for(std::vector<SharedAllocation>::const_iterator iter = Allocs.begin(), end = Allocs.end(); iter != end; ++iter) {
+	if(iter->Phaseless != (Phaseless != 0))
+	  continue;
+	if(Count++ == 0)
+	  OS << "    " << (Phaseless? "upcr_startup_pshalloc_t " : "upcr_startup_shalloc_t ") << Table << "[] = {\n";
+	OS << "        " << (Phaseless? "UPCRT_STARTUP_PSHALLOC(" : "UPCRT_STARTUP_SHALLOC(") << iter->Name << ", "
+	   << iter->BlockBytes << ", " << iter->NumBlocks << ", " << iter->MultByThreads << ", "
+	   << iter->ElementSize << ", \"" << iter->TypeString << "\"),\n";
+      }
+      if(Count != 0) {
+	OS << "    };\n";
+	OS << "    " << (Phaseless? "upcr_startup_pshalloc(" : "upcr_startup_shalloc(") << Table << ", " << Count << ");\n";
+      }
+    }
+    OS << "}\n";
+    return EXIT_SUCCESS;
+  }
+
+  // Translates the files named by a upc2c command line and
+  // returns the exit status.  Relative paths are interpreted
+  // relative to WorkingDir.
+  int RunCommandLine(llvm::opt::OptTable& Opts, int argc, const char ** argv, StringRef WorkingDir,
+		     FileManagerCache *Files, llvm::raw_ostream *Diags) {
+    using namespace llvm::opt;
+    using namespace clang::driver;
+
+    llvm::raw_ostream& Errs = Diags? *Diags : llvm::errs();
+
+    // Remove the options that upc2c handles itself
+    TranslatorOptions TransOpts;
+    SmallVector<const char *, 32> DriverArgs;
+    if(!ParseTranslatorOptions(argc, argv, TransOpts, DriverArgs))
+      return EXIT_FAILURE;
+
+    // The remaining arguments are manifests, not sources
+    if(!TransOpts.MergeAlloc.empty())
+      return MergeAllocManifests(TransOpts.MergeAlloc, ArrayRef<const char *>(DriverArgs).slice(1), WorkingDir, Errs);
+
+    // Parse the arguments
+    unsigned MissingArgIndex, MissingArgCount;
+    OwningPtr<InputArgList> Args(
+      Opts.ParseArgs(DriverArgs.begin(), DriverArgs.end(), MissingArgIndex, MissingArgCount));
+
+    // Read the output file and adjust the arguments
+    std::string OutputFile = Args->getLastArgValue(options::OPT_o);
+    Args->eraseArg(options::OPT_o);
 
-  FileManager * Files(new FileManager(FileSystemOptions()));
-  ToolInvocation tool(options, new RemoveUPCAction(OutputFile, get_file_id(InputFile)), Files);
-  if(tool.run()) {
+    std::vector<TranslationJob> Jobs;
+    AddTranslationJobs(*Args, OutputFile, WorkingDir, WorkingDir, Jobs);
+
+    // Add the translation units from the compilation database.
+    // Each one gets the default output name.
+    if(!TransOpts.CompileCommands.empty()) {
+      std::string ErrorMessage;
+      OwningPtr<CompilationDatabase> Database(
+	JSONCompilationDatabase::loadFromFile(MakeAbsolute(WorkingDir, TransOpts.CompileCommands), ErrorMessage));
+      if(!Database) {
+	Errs << "upc2c: " << ErrorMessage << "\n";
+	return EXIT_FAILURE;
+      }
+      std::vector<CompileCommand> Commands = Database->getAllCompileCommands();
+      for(std::vector<CompileCommand>::const_iterator iter = Commands.begin(), end = Commands.end(); iter != end; ++iter) {
+	std::vector<const char *> CommandArgs;
+	for(std::size_t i = 0; i < iter->CommandLine.size(); ++i)
+	  CommandArgs.push_back(iter->CommandLine[i].c_str());
+	OwningPtr<InputArgList> CommandArgList(
+	  Opts.ParseArgs(CommandArgs.data(), CommandArgs.data() + CommandArgs.size(), MissingArgIndex, MissingArgCount));
+	CommandArgList->eraseArg(options::OPT_o);
+	AddTranslationJobs(*CommandArgList, "", MakeAbsolute(WorkingDir, iter->Directory), WorkingDir, Jobs);
+      }
+    }
+
+    if(Jobs.empty()) {
+      Errs << "upc2c: no input files\n";
+      return EXIT_FAILURE;
+    }
+    if(!OutputFile.empty() && Jobs.size() > 1) {
+      Errs << "upc2c: cannot specify -o when translating multiple files\n";
+      return EXIT_FAILURE;
+    }
+    // The default output name only depends on the stem, so
+    // d1/foo.upc and d2/foo.upc would write the same file.
+    std::map<std::string, const TranslationJob *> Outputs;
+    for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter) {
+      std::pair<std::map<std::string, const TranslationJob *>::iterator, bool> Inserted =
+	Outputs.insert(std::make_pair(iter->OutputFile, &*iter));
+      if(!Inserted.second) {
+	Errs << "upc2c: '" << MakeAbsolute(Inserted.first->second->WorkingDir, Inserted.first->second->InputFile)
+	     << "' and '" << MakeAbsolute(iter->WorkingDir, iter->InputFile)
+	     << "' would both be translated to '" << iter->OutputFile << "'\n";
+	return EXIT_FAILURE;
+      }
+    }
+
+    std::string PCHDir = TransOpts.PCHDir.empty()? "" : MakeAbsolute(WorkingDir, TransOpts.PCHDir);
+    for(std::vector<TranslationJob>::iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter) {
+      iter->PCHDir = PCHDir;
+      iter->TransformOptions = TransOpts.Transform;
+    }
+
+    unsigned NumThreads = TransOpts.Jobs;
+    if(NumThreads == 0) {
+      long Online = sysconf(_SC_NPROCESSORS_ONLN);
+      NumThreads = Online > 0? static_cast<unsigned>(Online) : 1;
+    }
+    // The time report measures the whole process, so other
+    // workers would be counted in each file's numbers
+    if(TransOpts.Transform.TimeReport)
+      NumThreads = 1;
+
+    TranslationQueue Queue(Jobs, Diags);
+    if(Queue.run(NumThreads, Files) == 0) {
+      return EXIT_SUCCESS;
+    } else {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The server protocol is a sequence of NUL terminated
+  // strings, ended by an empty string.  The first string is
+  // the command:
+  //   translate <cwd> <argv...>
+  //     Translate as if upc2c had been run with argv in cwd.
+  //     The reply is "exit <status>\n" followed by diagnostics.
+  //   stats
+  //     The reply lists the request counters and latencies.
+  //   shutdown
+  //     Stop the server.
+  bool ReadRequest(int FD, std::vector<std::string>& Request) {
+    std::string Current;
+    char Buffer[4096];
+    for(;;) {
+      ssize_t Count = read(FD, Buffer, sizeof(Buffer));
+      if(Count < 0 && errno == EINTR)
+	continue;
+      if(Count <= 0)
+	return false;
+      for(ssize_t i = 0; i < Count; ++i) {
+	if(Buffer[i] != '\0') {
+	  Current += Buffer[i];
+	} else if(Current.empty()) {
+	  return true;
+	} else {
+	  Request.push_back(Current);
+	  Current.clear();
+	}
+      }
+    }
+  }
+
+  bool WriteAll(int FD, StringRef Data) {
+    while(!Data.empty()) {
+      ssize_t Count = write(FD, Data.data(), Data.size());
+      if(Count < 0 && errno == EINTR)
+	continue;
+      if(Count <= 0)
+	return false;
+      Data = Data.substr(Count);
+    }
+    return true;
+  }
+
+  int OpenSocket(StringRef Path, sockaddr_un& Addr) {
+    if(Path.size() >= sizeof(Addr.sun_path)) {
+      llvm::errs() << "upc2c: socket path too long: " << Path << "\n";
+      return -1;
+    }
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    memcpy(Addr.sun_path, Path.data(), Path.size());
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+
+  // Removes a stale socket left at Path.  Anything that
+  // is not a socket is left alone, so that bind fails.
+  void RemoveSocket(const char *Path) {
+    struct stat Status;
+    if(lstat(Path, &Status) == 0 && S_ISSOCK(Status.st_mode))
+      unlink(Path);
+  }
+
+  struct ServerStats {
+    ServerStats() : Requests(0), Failures(0), TotalSeconds(0), MinSeconds(0), MaxSeconds(0) {}
+    void record(double Seconds, bool Success) {
+      if(Requests == 0 || Seconds < MinSeconds)
+	MinSeconds = Seconds;
+      if(Seconds > MaxSeconds)
+	MaxSeconds = Seconds;
+      ++Requests;
+      if(!Success)
+	++Failures;
+      TotalSeconds += Seconds;
+    }
+    void print(llvm::raw_ostream& OS, double Uptime) const {
+      OS << "requests " << Requests << "\n";
+      OS << "failures " << Failures << "\n";
+      OS << "uptime_seconds " << llvm::format("%.3f", Uptime) << "\n";
+      OS << "busy_seconds " << llvm::format("%.3f", TotalSeconds) << "\n";
+      OS << "min_latency_ms " << llvm::format("%.3f", MinSeconds * 1000) << "\n";
+      OS << "mean_latency_ms " << llvm::format("%.3f", Requests? TotalSeconds * 1000 / Requests : 0.0) << "\n";
+      OS << "max_latency_ms " << llvm::format("%.3f", MaxSeconds * 1000) << "\n";
+      OS << "requests_per_second " << llvm::format("%.3f", Uptime > 0? Requests / Uptime : 0.0) << "\n";
+    }
+    uint64_t Requests;
+    uint64_t Failures;
+    double TotalSeconds;
+    double MinSeconds;
+    double MaxSeconds;
+  };
+
+  // Serves translation requests on a Unix domain socket.  The
+  // option table and the FileManagers, with the stat cache that
+  // header search goes through, stay alive between requests.
+  // Before each request, a FileManager that has seen a file
+  // that changed since is dropped.  Lookups that failed are
+  // cached as well and can't be checked that way, so all the
+  // FileManagers are dropped after a failed translation, e.g.
+  // when a missing header is about to be created.
+  //
+  // Connections are served one at a time, so a client waits
+  // for the translations of the clients before it.  Start one
+  // server per build job for concurrent translations.
+  int RunServer(StringRef Path) {
+    sockaddr_un Addr;
+    int Listener = OpenSocket(Path, Addr);
+    if(Listener < 0) {
+      llvm::errs() << "upc2c: cannot create socket: " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    // Only the owner may connect
+    RemoveSocket(Addr.sun_path);
+    mode_t OldMask = umask(0077);
+    int Status = bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr));
+    umask(OldMask);
+    if(Status != 0 || listen(Listener, 16) != 0) {
+      llvm::errs() << "upc2c: cannot listen on " << Path << ": " << strerror(errno) << "\n";
+      close(Listener);
+      return EXIT_FAILURE;
+    }
+    // A client that goes away before its reply must
+    // not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    OwningPtr<llvm::opt::OptTable> Opts(clang::driver::createDriverOptTable());
+    FileManagerCache Files;
+    ServerStats Stats;
+    double Start = llvm::TimeRecord::getCurrentTime().getWallTime();
+    bool Done = false;
+    while(!Done) {
+      int Connection = accept(Listener, NULL, NULL);
+      if(Connection < 0) {
+	if(errno == EINTR)
+	  continue;
+	break;
+      }
+      std::vector<std::string> Request;
+      std::string Reply;
+      llvm::raw_string_ostream OS(Reply);
+      if(!ReadRequest(Connection, Request) || Request.empty()) {
+	OS << "error malformed request\n";
+      } else if(Request[0] == "translate" && Request.size() >= 3) {
+	double RequestStart = llvm::TimeRecord::getCurrentTime().getWallTime();
+	std::vector<const char *> Argv;
+	for(std::size_t i = 2; i < Request.size(); ++i)
+	  Argv.push_back(Request[i].c_str());
+	std::string Diagnostics;
+	llvm::raw_string_ostream DiagOS(Diagnostics);
+	Files.revalidate();
+	int Result = RunCommandLine(*Opts, Argv.size(), Argv.data(), Request[1], &Files, &DiagOS);
+	if(Result != EXIT_SUCCESS)
+	  Files.clear();
+	DiagOS.flush();
+	Stats.record(llvm::TimeRecord::getCurrentTime().getWallTime() - RequestStart, Result == EXIT_SUCCESS);
+	OS << "exit " << Result << "\n" << Diagnostics;
+      } else if(Request[0] == "stats") {
+	Stats.print(OS, llvm::TimeRecord::getCurrentTime().getWallTime() - Start);
+      } else if(Request[0] == "shutdown") {
+	OS << "ok\n";
+	Done = true;
+      } else {
+	OS << "error unknown request " << Request[0] << "\n";
+      }
+      OS.flush();
+      WriteAll(Connection, Reply);
+      close(Connection);
+    }
+    close(Listener);
+    RemoveSocket(Addr.sun_path);
     return EXIT_SUCCESS;
-  } else {
+  }
+
+  // Sends the translation to a server.  Returns -1 if
+  // the server could not be reached, so that the caller
+  // can fall back to translating locally.
+  int RunClient(StringRef Path, const SmallVectorImpl<const char *>& Argv) {
+    sockaddr_un Addr;
+    int FD = OpenSocket(Path, Addr);
+    if(FD < 0)
+      return -1;
+    if(connect(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0) {
+      close(FD);
+      return -1;
+    }
+    SmallString<256> WorkingDir;
+    llvm::sys::fs::current_path(WorkingDir);
+    std::string Request("translate");
+    Request += '\0';
+    Request += WorkingDir.str();
+    Request += '\0';
+    for(std::size_t i = 0; i < Argv.size(); ++i) {
+      Request += Argv[i];
+      Request += '\0';
+    }
+    Request += '\0';
+    if(!WriteAll(FD, Request)) {
+      close(FD);
+      return -1;
+    }
+    std::string Reply;
+    char Buffer[4096];
+    for(;;) {
+      ssize_t Count = read(FD, Buffer, sizeof(Buffer));
+      if(Count < 0 && errno == EINTR)
+	continue;
+      if(Count <= 0)
+	break;
+      Reply.append(Buffer, Count);
+    }
+    close(FD);
+    StringRef Status = StringRef(Reply).split('\n').first;
+    int Result;
+    if(!Status.startswith("exit ") || Status.substr(5).getAsInteger(10, Result))
+      return -1;
+    llvm::errs() << StringRef(Reply).split('\n').second;
+    return Result;
+  }
+
+}
+
+int main(int argc, const char ** argv) {
+  TranslatorOptions TransOpts;
+  SmallVector<const char *, 32> Argv;
+  if(!ParseTranslatorOptions(argc, argv, TransOpts, Argv))
     return EXIT_FAILURE;
+
+  if(!TransOpts.ServerSocket.empty()) {
+    return RunServer(TransOpts.ServerSocket);
+  }
+
+  // Forward everything except --connect to the server
+  if(!TransOpts.ConnectSocket.empty()) {
+    SmallVector<const char *, 32> Forwarded;
+    for(int i = 0; i < argc; ++i) {
+      if(!StringRef(argv[i]).startswith("--connect="))
+	Forwarded.push_back(argv[i]);
+    }
+    int Result = RunClient(TransOpts.ConnectSocket, Forwarded);
+    if(Result >= 0)
+      return Result;
   }
+
+  OwningPtr<llvm::opt::OptTable> Opts(clang::driver::createDriverOptTable());
+  return RunCommandLine(*Opts, argc, argv, "", NULL, NULL);
 }
@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+"""Writes a synthetic UPC translation unit for benchmarking upc2c.
+
+The size of the generated file is controlled by the number of
+functions, the shared accesses per function, the number of shared
+globals and the nesting depth of the upc_forall loops that contain
+the accesses.
+"""
+
+import argparse
+import sys
+
+BLOCK_SIZES = [0, 1, 4, 16, 64]
+
+
+def global_decl(index):
+    block = BLOCK_SIZES[index % len(BLOCK_SIZES)]
+    # An indefinite block size can't have THREADS in the dimension
+    if block == 0:
+        return "shared [] double g%d[2048];" % index
+    return "shared [%d] double g%d[2048 * THREADS];" % (block, index)
+
+
+def access(func, index, globals_count, depth):
+    # Alternate reads, writes and read-modify-writes over the globals
+    src = "g%d" % ((func + index) % globals_count)
+    dst = "g%d" % ((func + index + 1) % globals_count)
+    subscript = " + ".join("i%d" % d for d in range(depth)) or "0"
+    kind = index % 3
+    if kind == 0:
+        return "sum += %s[%s];" % (src, subscript)
+    elif kind == 1:
+        return "%s[%s] = sum;" % (dst, subscript)
+    else:
+        return "%s[%s] += %s[%s] * 0.5;" % (dst, subscript, src, subscript)
+
+
+def function(func, accesses, globals_count, depth):
+    lines = ["double f%d(void) {" % func]
+    if depth:
+        lines.append("  int %s;" % ", ".join("i%d" % d for d in range(depth)))
+    lines.append("  double sum = 0.0;")
+    indent = "  "
+    for d in range(depth):
+        lines.append("%supc_forall(i%d = 0; i%d < 256; ++i%d; &g%d[i%d]) {"
+                     % (indent, d, d, d, func % globals_count, d))
+        indent += "  "
+    for a in range(accesses):
+        lines.append(indent + access(func, a, globals_count, depth))
+    for d in reversed(range(depth)):
+        indent = indent[:-2]
+        lines.append(indent + "}")
+    lines.append("  upc_barrier;")
+    lines.append("  return sum;")
+    lines.append("}")
+    return "\n".join(lines)
+
+
+def generate(functions, accesses, globals_count, depth):
+    out = ["/* Generated by gen_synthetic.py: functions=%d accesses=%d globals=%d depth=%d */"
+           % (functions, accesses, globals_count, depth),
+           "#include <upc_relaxed.h>",
+           ""]
+    out.extend(global_decl(g) for g in range(globals_count))
+    out.append("")
+    for f in range(functions):
+        out.append(function(f, accesses, globals_count, depth))
+        out.append("")
+    out.append("int main(void) {")
+    out.append("  double total = 0.0;")
+    for f in range(functions):
+        out.append("  total += f%d();" % f)
+    out.append("  return total > 0.0;")
+    out.append("}")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--functions", type=int, default=10)
+    parser.add_argument("--accesses", type=int, default=10, help="shared accesses per function")
+    parser.add_argument("--globals", type=int, default=4, help="number of shared arrays")
+    parser.add_argument("--depth", type=int, default=1, help="nesting depth of upc_forall loops")
+    parser.add_argument("-o", "--output", help="output file (default: stdout)")
+    args = parser.parse_args()
+    if args.globals < 1:
+        parser.error("--globals must be at least 1")
+    text = generate(args.functions, args.accesses, args.globals, args.depth)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,256 @@
+#!/usr/bin/env python
+"""Measures the translation throughput of upc2c.
+
+Translates the kernels in bench/kernels and series of synthetic
+inputs from gen_synthetic.py, one upc2c process per input, and
+reports the translation time, peak memory and output size of each.
+Times and memory come from upc2c --time-report.  For each synthetic
+series, the growth of the time, peak memory and output size from one
+size to the next is reported as an exponent, and exponents well above
+1 are flagged as super-linear.
+
+With --compare-engines, the kernels and the largest input of each
+series are also translated with --engine=reprint and --engine=rewrite,
+and the time and peak memory of the two are printed side by side.
+
+With --compare-temps, the same inputs are translated with and without
+-fno-upc-scoped-temps, and the number of _bupc_spilld declarations in
+each output is printed.  If --cc is given, each output is also compiled
+with -fstack-usage, and the C compile time and the largest and total
+stack frame sizes are printed too.
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import gen_synthetic  # noqa: E402
+
+BASE = {"functions": 8, "accesses": 8, "globals": 4, "depth": 1}
+SERIES = {
+    "functions": [8, 16, 32, 64, 128],
+    "accesses": [8, 16, 32, 64, 128],
+    "globals": [4, 8, 16, 32, 64],
+    "depth": [1, 2, 3, 4, 5],
+}
+QUICK_SERIES = dict((name, sizes[:3]) for name, sizes in SERIES.items())
+# Growth exponents above this are reported as super-linear
+SUPERLINEAR = 1.3
+# A declaration of a spill temporary, e.g. "int _bupc_spilld3;"
+TEMP_DECL = re.compile(r"^\s*(?!return\b)[A-Za-z_][^=();]*[\s*]_bupc_spilld\d+;\s*$", re.M)
+
+
+def translate(upc2c, flags, source, work_dir, repeat):
+    stem = os.path.splitext(os.path.basename(source))[0]
+    output = os.path.join(work_dir, stem + ".trans.c")
+    report = os.path.join(work_dir, stem + ".trans.time.json")
+    best = None
+    for _ in range(repeat):
+        command = [upc2c, "--time-report"] + flags + [source, "-o", output]
+        start = time.time()
+        proc = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        _, err = proc.communicate()
+        elapsed = time.time() - start
+        if proc.returncode != 0:
+            sys.stderr.write(err.decode("utf-8", "replace"))
+            raise RuntimeError("upc2c failed on %s" % source)
+        with open(report) as f:
+            data = json.load(f)
+        result = {
+            "input": source,
+            "process_seconds": elapsed,
+            "translate_seconds": sum(p["wall"] for p in data["phases"]),
+            "phases": dict((p["name"], p["wall"]) for p in data["phases"]),
+            "peak_rss_kb": data["peak_rss_kb"],
+            "input_bytes": os.path.getsize(source),
+            "output_bytes": os.path.getsize(output),
+            "slowest_decls": data["slowest_decls"][:3],
+        }
+        if best is None or result["translate_seconds"] < best["translate_seconds"]:
+            best = result
+    return best
+
+
+def growth(points, key, size_key):
+    """Returns the exponent k in value ~ size**k between successive points."""
+    exponents = []
+    for a, b in zip(points, points[1:]):
+        if a[key] <= 0 or b[key] <= 0 or a[size_key] == b[size_key]:
+            exponents.append(None)
+            continue
+        exponents.append(math.log(float(b[key]) / a[key]) / math.log(float(b[size_key]) / a[size_key]))
+    return exponents
+
+
+def print_row(name, r):
+    print("%-32s %10.4f %10d %12d %12d" % (name, r["translate_seconds"], r["peak_rss_kb"],
+                                            r["input_bytes"], r["output_bytes"]))
+
+
+def compare_engines(args, sources, work_dir):
+    """Translates each source with both engines and returns the results."""
+    print("")
+    print("engines: reprint vs rewrite")
+    print("%-32s %10s %10s %10s %10s" % ("input", "reprint s", "rewrite s", "reprint KB", "rewrite KB"))
+    comparison = []
+    for source in sources:
+        flags = [f for f in args.flags if not f.startswith("--engine=")]
+        reprint = translate(args.upc2c, flags + ["--engine=reprint"], source, work_dir, args.repeat)
+        rewrite = translate(args.upc2c, flags + ["--engine=rewrite"], source, work_dir, args.repeat)
+        print("%-32s %10.4f %10.4f %10d %10d" % (os.path.basename(source), reprint["translate_seconds"],
+                                                 rewrite["translate_seconds"], reprint["peak_rss_kb"],
+                                                 rewrite["peak_rss_kb"]))
+        comparison.append({"input": source, "reprint": reprint, "rewrite": rewrite})
+    return comparison
+
+
+def compile_output(args, output):
+    """Compiles a translated file and returns the compile time and stack frame sizes."""
+    obj = os.path.splitext(output)[0] + ".o"
+    usage = os.path.splitext(output)[0] + ".su"
+    if os.path.exists(usage):
+        os.remove(usage)
+    command = [args.cc, "-c", "-fstack-usage"] + args.cc_flags.split() + [output, "-o", obj]
+    best = None
+    for _ in range(args.repeat):
+        start = time.time()
+        proc = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        _, err = proc.communicate()
+        elapsed = time.time() - start
+        if proc.returncode != 0:
+            sys.stderr.write(err.decode("utf-8", "replace"))
+            raise RuntimeError("%s failed on %s" % (args.cc, output))
+        if best is None or elapsed < best:
+            best = elapsed
+    frames = []
+    with open(usage) as f:
+        for line in f:
+            fields = line.rstrip("\n").split("\t")
+            if len(fields) >= 2 and fields[1].isdigit():
+                frames.append(int(fields[1]))
+    return {"compile_seconds": best, "max_frame_bytes": max(frames or [0]),
+            "total_frame_bytes": sum(frames)}
+
+
+def compare_temps(args, sources, work_dir):
+    """Translates each source with and without scoped temporaries and returns the results."""
+    print("")
+    print("temporaries: -fno-upc-scoped-temps vs -fupc-scoped-temps")
+    columns = ("input", "old temps", "new temps")
+    if args.cc:
+        columns += ("old cc s", "new cc s", "old frame", "new frame")
+    print(("%-32s" + " %10s" * (len(columns) - 1)) % columns)
+    comparison = []
+    for source in sources:
+        flags = [f for f in args.flags if f not in ("-fupc-scoped-temps", "-fno-upc-scoped-temps")]
+        row = {"input": source}
+        for name, flag in (("old", "-fno-upc-scoped-temps"), ("new", "-fupc-scoped-temps")):
+            sub_dir = os.path.join(work_dir, name + "-temps")
+            if not os.path.isdir(sub_dir):
+                os.makedirs(sub_dir)
+            r = translate(args.upc2c, flags + [flag], source, sub_dir, args.repeat)
+            stem = os.path.splitext(os.path.basename(source))[0]
+            output = os.path.join(sub_dir, stem + ".trans.c")
+            with open(output) as f:
+                r["temp_decls"] = len(TEMP_DECL.findall(f.read()))
+            if args.cc:
+                r.update(compile_output(args, output))
+            row[name] = r
+        values = (os.path.basename(source), row["old"]["temp_decls"], row["new"]["temp_decls"])
+        line = "%-32s %10d %10d" % values
+        if args.cc:
+            line += " %10.4f %10.4f %10d %10d" % (row["old"]["compile_seconds"], row["new"]["compile_seconds"],
+                                                  row["old"]["max_frame_bytes"], row["new"]["max_frame_bytes"])
+        print(line)
+        comparison.append(row)
+    return comparison
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--upc2c", required=True, help="the upc2c executable")
+    parser.add_argument("--work-dir", default="upc2c-bench", help="where inputs and outputs are written")
+    parser.add_argument("--repeat", type=int, default=3, help="translations per input; the fastest is kept")
+    parser.add_argument("--quick", action="store_true", help="run shorter synthetic series")
+    parser.add_argument("--results", help="write all results as JSON to this file")
+    parser.add_argument("--compare-engines", action="store_true",
+                        help="also compare the reprint and rewrite engines")
+    parser.add_argument("--compare-temps", action="store_true",
+                        help="also compare the outputs with and without scoped temporaries")
+    parser.add_argument("--cc", help="with --compare-temps, compile the outputs with this C compiler")
+    parser.add_argument("--cc-flags", default="", help="flags for --cc, e.g. the upcr include paths")
+    parser.add_argument("flags", nargs="*", help="extra upc2c arguments, e.g. -I for the UPC headers (after --)")
+    args = parser.parse_args()
+
+    work_dir = os.path.abspath(args.work_dir)
+    if not os.path.isdir(work_dir):
+        os.makedirs(work_dir)
+    results = {"kernels": [], "series": {}}
+    header = "%-32s %10s %10s %12s %12s" % ("input", "time (s)", "RSS (KB)", "input (B)", "output (B)")
+
+    print(header)
+    kernel_dir = os.path.join(HERE, "kernels")
+    compare_inputs = []
+    for name in sorted(os.listdir(kernel_dir)):
+        if not name.endswith(".upc"):
+            continue
+        r = translate(args.upc2c, args.flags, os.path.join(kernel_dir, name), work_dir, args.repeat)
+        results["kernels"].append(r)
+        compare_inputs.append(r["input"])
+        print_row(name, r)
+
+    superlinear = []
+    for param, sizes in sorted((QUICK_SERIES if args.quick else SERIES).items()):
+        print("")
+        print("series: %s" % param)
+        print(header)
+        points = []
+        for size in sizes:
+            config = dict(BASE)
+            config[param] = size
+            source = os.path.join(work_dir, "synthetic_%s_%d.upc" % (param, size))
+            with open(source, "w") as f:
+                f.write(gen_synthetic.generate(config["functions"], config["accesses"],
+                                               config["globals"], config["depth"]))
+            r = translate(args.upc2c, args.flags, source, work_dir, args.repeat)
+            r["size"] = size
+            points.append(r)
+            print_row(os.path.basename(source), r)
+        # Nesting depth doesn't scale the input linearly, so
+        # compare against the input size instead.
+        size_key = "input_bytes" if param == "depth" else "size"
+        time_growth = growth(points, "translate_seconds", size_key)
+        rss_growth = growth(points, "peak_rss_kb", size_key)
+        output_growth = growth(points, "output_bytes", size_key)
+        for i, exponents in enumerate(zip(time_growth, rss_growth, output_growth)):
+            step = "%s %d -> %d" % (param, sizes[i], sizes[i + 1])
+            print("  %-28s time x^%s, RSS x^%s, output x^%s" %
+                  ((step,) + tuple("%.2f" % e if e is not None else "?" for e in exponents)))
+            if any(e is not None and e > SUPERLINEAR for e in exponents):
+                superlinear.append(step)
+        results["series"][param] = {"points": points, "time_growth": time_growth,
+                                    "rss_growth": rss_growth, "output_growth": output_growth}
+        compare_inputs.append(points[-1]["input"])
+
+    if args.compare_engines:
+        results["engines"] = compare_engines(args, compare_inputs, work_dir)
+    if args.compare_temps:
+        results["temps"] = compare_temps(args, compare_inputs, work_dir)
+
+    if superlinear:
+        print("")
+        print("super-linear growth: %s" % ", ".join(superlinear))
+    if args.results:
+        with open(args.results, "w") as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()